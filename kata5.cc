@@ -51,6 +51,11 @@
 
 #include <boost/test/unit_test.hpp>
 #include <boost/static_assert.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/bind.hpp>
+#include <boost/utility.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include <string>
 #include <bitset>
@@ -59,9 +64,22 @@
 #include <fstream>
 #include <set>
 #include <iomanip>
+#include <stdexcept>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include <cstdlib>
+#include <limits>
 
 extern "C" {
 #include <openssl/md5.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
 };
 
 using boost::unit_test_framework::test_suite;
@@ -71,11 +89,52 @@ const string dict = "/usr/share/dict/words";
 
 typedef vector<unsigned int> hash_list;
 
+// On-disk bloom filter format: this header, followed by the map as an
+// array of 64-bit words in native byte order, where bit n of the map is
+// bit (n % 64) of word (n / 64).  A file written on a machine of the other
+// endianness fails the version check rather than giving wrong answers.
+struct bloom_file_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t policy_id;
+  uint32_t n_hashes;
+  uint32_t seed;
+  uint64_t map_size;
+};
+
+const char bloom_file_magic[8] = "KATA5BF";
+const uint32_t bloom_file_version = 1;
+
+template <class hash_fn>
+void write_bloom_file(const string& filename, uint64_t map_size,
+                      const vector<uint64_t>& map)
+{
+  bloom_file_header header;
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, bloom_file_magic, sizeof header.magic);
+  header.version = bloom_file_version;
+  header.policy_id = hash_fn::policy_id;
+  header.n_hashes = hash_fn::n_hashes;
+  header.seed = hash_fn::seed;
+  header.map_size = map_size;
+
+  ofstream f(filename.c_str(), ios::binary | ios::trunc);
+  f.write(reinterpret_cast<const char *>(&header), sizeof header);
+  f.write(reinterpret_cast<const char *>(&map[0]),
+          map.size() * sizeof(uint64_t));
+  if(!f) {
+    throw runtime_error("Unable to write bloom filter to " + filename);
+  }
+}
+
 template <class hash_fn,
           typename hash_list::value_type map_size = hash_fn::map_size>
 class bloom_filter 
 {
   static const hash_list::value_type ms;
+  // Words hashed at a time by the batched insert() and lookup().
+  static const size_t batch = 64;
 
   bitset<map_size> map;
   hash_fn hashes;
@@ -89,6 +148,22 @@ class bloom_filter
     }
   }
 
+  // Batched versions, for hash policies which can hash several words at
+  // once (md5_hash).
+  void insert(const vector<string>& words)
+  {
+    hash_list h[batch];
+    for(size_t w = 0; w < words.size(); w += batch) {
+      const size_t n = min<size_t>(words.size() - w, batch);
+      hashes(&words[w], n, h);
+      for(size_t j = 0; j < n; j++) {
+        for(hash_list::const_iterator i = h[j].begin(); i != h[j].end(); i++) {
+          map.set(*i);
+        }
+      }
+    }
+  }
+
   void load_dictionary(const string& dictfile)
   {
     ifstream d(dictfile.c_str());
@@ -109,11 +184,41 @@ class bloom_filter
     return true;
   }
 
+  // Sets found[i] to lookup(words[i]).
+  void lookup(const vector<string>& words, vector<bool>& found) const
+  {
+    hash_list h[batch];
+    found.assign(words.size(), true);
+    for(size_t w = 0; w < words.size(); w += batch) {
+      const size_t n = min<size_t>(words.size() - w, batch);
+      hashes(&words[w], n, h);
+      for(size_t j = 0; j < n; j++) {
+        for(hash_list::const_iterator i = h[j].begin(); i != h[j].end(); i++) {
+          if(!map[*i]) {
+            found[w + j] = false;
+            break;
+          }
+        }
+      }
+    }
+  }
+
   unsigned int saturation() const
   {
     return (map.count() * 100) / map_size;
   }
 
+  void save(const string& filename) const
+  {
+    vector<uint64_t> words((map_size + 63) / 64, 0);
+    for(size_t i = 0; i < map_size; i++) {
+      if(map[i]) {
+        words[i / 64] |= uint64_t(1) << (i % 64);
+      }
+    }
+    write_bloom_file<hash_fn>(filename, map_size, words);
+  }
+
   hash_list::value_type get_map_size() const
   {
     return ms;
@@ -129,12 +234,363 @@ template <class hash_fn,
           typename hash_list::value_type map_size>
 const hash_list::value_type bloom_filter<hash_fn, map_size>::ms = map_size;
 
+template <class hash_fn,
+          typename hash_list::value_type map_size>
+const size_t bloom_filter<hash_fn, map_size>::batch;
+
+// A bloom filter which can be shared between threads.  The map is held as
+// an array of 64-bit words and each bit is set with an atomic fetch-or, so
+// any number of threads can insert while others are looking words up.
+// Lookups may miss an insert which is still in progress, but will never
+// see a word which has been fully inserted as missing.
+template <class hash_fn,
+          typename hash_list::value_type map_size = hash_fn::map_size>
+class concurrent_bloom_filter
+{
+  typedef uint64_t word;
+  static const hash_list::value_type ms;
+  static const unsigned int word_bits = sizeof(word) << 3;
+
+  vector<word> map;
+  hash_fn hashes;
+
+  void set(hash_list::value_type bit)
+  {
+    __atomic_fetch_or(&map[bit / word_bits], word(1) << (bit % word_bits),
+                      __ATOMIC_RELAXED);
+  }
+
+  bool test(hash_list::value_type bit) const
+  {
+    return __atomic_load_n(&map[bit / word_bits], __ATOMIC_RELAXED)
+      & (word(1) << (bit % word_bits));
+  }
+
+  // Two words at a time, using GCC's vector extensions (so SSE2 or
+  // AltiVec as the target allows).  The words need only be aligned as
+  // words, and may be read as blocks.
+  typedef word block
+    __attribute__((vector_size(2 * sizeof(word)), aligned(sizeof(word)),
+                   may_alias));
+
+  // Only for use when nothing is inserting concurrently, and with dst and
+  // src not overlapping.
+  static void or_words(word *__restrict dst, const word *__restrict src,
+                       size_t n)
+  {
+    size_t i = 0;
+    for(; i + 2 <= n; i += 2) {
+      *reinterpret_cast<block *>(dst + i)
+        |= *reinterpret_cast<const block *>(src + i);
+    }
+    for(; i < n; i++) {
+      dst[i] |= src[i];
+    }
+  }
+
+  static void and_words(word *__restrict dst, const word *__restrict src,
+                        size_t n)
+  {
+    size_t i = 0;
+    for(; i + 2 <= n; i += 2) {
+      *reinterpret_cast<block *>(dst + i)
+        &= *reinterpret_cast<const block *>(src + i);
+    }
+    for(; i < n; i++) {
+      dst[i] &= src[i];
+    }
+  }
+
+  // Insert every line which starts within [begin, end) of the file.  A
+  // line straddling begin belongs to the previous range.
+  void load_range(const string& dictfile, streamoff begin, streamoff end)
+  {
+    ifstream d(dictfile.c_str());
+    string line;
+    streamoff pos = begin;
+    if(begin != 0) {
+      d.seekg(begin - 1);
+      getline(d, line);
+      pos += line.size();
+    }
+    while(pos < end && getline(d, line)) {
+      insert(line);
+      pos += line.size() + 1;
+    }
+  }
+
+ public:
+  concurrent_bloom_filter()
+    : map((map_size + word_bits - 1) / word_bits, 0)
+  {
+  }
+
+  void insert(const string& word)
+  {
+    hash_list h = hashes(word);
+    for(hash_list::const_iterator i = h.begin(); i != h.end(); i++) {
+      set(*i);
+    }
+  }
+
+  // Load the dictionary, splitting the file into roughly equal byte
+  // ranges which are read and inserted by n_threads worker threads.
+  void load_dictionary(const string& dictfile,
+                       unsigned int n_threads = boost::thread::hardware_concurrency())
+  {
+    ifstream d(dictfile.c_str(), ios::binary);
+    d.seekg(0, ios::end);
+    const streamoff size = d.tellg();
+    if(size <= 0) {
+      return;
+    }
+    if(n_threads == 0) {
+      n_threads = 1;
+    }
+
+    boost::thread_group workers;
+    for(unsigned int i = 0; i < n_threads; i++) {
+      workers.create_thread(boost::bind(&concurrent_bloom_filter::load_range,
+                                        this, dictfile,
+                                        size * i / n_threads,
+                                        size * (i + 1) / n_threads));
+    }
+    workers.join_all();
+  }
+
+  // Load a dictionary which has been split into several files: each
+  // shard is built into its own filter on its own thread, with no
+  // contention between them, and the results are merged into this one.
+  void load_shards(const vector<string>& shard_files)
+  {
+    vector<concurrent_bloom_filter> shards(shard_files.size());
+    boost::thread_group workers;
+    for(size_t i = 0; i < shard_files.size(); i++) {
+      workers.create_thread(boost::bind(&concurrent_bloom_filter::load_range,
+                                        &shards[i], shard_files[i], 0,
+                                        numeric_limits<streamoff>::max()));
+    }
+    workers.join_all();
+
+    for(size_t i = 0; i < shards.size(); i++) {
+      merge_union(shards[i]);
+    }
+  }
+
+  // Merge in another filter with the same hash policy and map size (for
+  // example a shard saved by another process and opened with
+  // mapped_bloom_filter).  The union holds every word either held; the
+  // intersection holds every word both held, plus some false positives
+  // beyond what a filter built from just those words would have.
+  template <template <class, hash_list::value_type> class other>
+  void merge_union(const other<hash_fn, map_size>& f)
+  {
+    if(f.words() != &map[0]) { // Merging with itself changes nothing
+      or_words(&map[0], f.words(), map.size());
+    }
+  }
+
+  template <template <class, hash_list::value_type> class other>
+  void merge_intersection(const other<hash_fn, map_size>& f)
+  {
+    if(f.words() != &map[0]) {
+      and_words(&map[0], f.words(), map.size());
+    }
+  }
+
+  bool lookup(const string& word) const
+  {
+    hash_list h = hashes(word);
+    for(hash_list::const_iterator i = h.begin(); i != h.end(); i++) {
+      if(!test(*i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  unsigned long long bits_set() const
+  {
+    unsigned long long count = 0;
+    for(typename vector<word>::const_iterator i = map.begin();
+        i != map.end(); i++) {
+      count += __builtin_popcountll(__atomic_load_n(&*i, __ATOMIC_RELAXED));
+    }
+    return count;
+  }
+
+  unsigned int saturation() const
+  {
+    return (bits_set() * 100) / map_size;
+  }
+
+  // Estimate how many distinct words have been inserted from how many
+  // bits are set (Swamidass & Baldi).  This also works for the result of
+  // a merge, but needs a hash policy with a fixed number of hashes.  It
+  // assumes the hashes are independent and uniform; md5_hash's final,
+  // partly empty, hash isn't, so expect an underestimate of 10-15%.
+  double estimated_size() const
+  {
+    if(hash_fn::n_hashes == 0) {
+      throw logic_error(hashes.get_name()
+                        + " doesn't have a fixed number of hashes");
+    }
+    const double m = map_size;
+    const double x = bits_set();
+    if(x >= m) {
+      return numeric_limits<double>::infinity();
+    }
+    return -(m / hash_fn::n_hashes) * log(1 - x / m);
+  }
+
+  const word *words() const
+  {
+    return &map[0];
+  }
+
+  // Only safe once all inserting threads have finished.
+  void save(const string& filename) const
+  {
+    write_bloom_file<hash_fn>(filename, map_size, map);
+  }
+
+  hash_list::value_type get_map_size() const
+  {
+    return ms;
+  }
+
+  const string& get_hash_name() const
+  {
+    return hashes.get_name();
+  }
+};
+
+template <class hash_fn,
+          typename hash_list::value_type map_size>
+const hash_list::value_type
+concurrent_bloom_filter<hash_fn, map_size>::ms = map_size;
+
+// A read-only bloom filter opened from a file written by save().  The map
+// is memory-mapped rather than read, so opening is cheap and every process
+// using the same file shares one copy of it in the page cache.  Opening a
+// file written with a different hash policy (or map size) throws.
+template <class hash_fn,
+          typename hash_list::value_type map_size = hash_fn::map_size>
+class mapped_bloom_filter : boost::noncopyable
+{
+  static const hash_list::value_type ms;
+
+  void *base;
+  size_t length;
+  const uint64_t *map;
+  hash_fn hashes;
+
+  bool test(hash_list::value_type bit) const
+  {
+    return map[bit / 64] & (uint64_t(1) << (bit % 64));
+  }
+
+  void check(bool condition, const string& filename, const string& reason)
+  {
+    if(!condition) {
+      munmap(base, length);
+      throw runtime_error("Cannot open bloom filter " + filename + ": "
+                          + reason);
+    }
+  }
+
+ public:
+  mapped_bloom_filter(const string& filename)
+  {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+      throw runtime_error("Cannot open bloom filter " + filename);
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < off_t(sizeof(bloom_file_header))) {
+      close(fd);
+      throw runtime_error("Cannot open bloom filter " + filename
+                          + ": file is truncated");
+    }
+    length = st.st_size;
+    base = mmap(0, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+      throw runtime_error("Cannot map bloom filter " + filename);
+    }
+
+    const bloom_file_header *header
+      = static_cast<const bloom_file_header *>(base);
+    check(memcmp(header->magic, bloom_file_magic, sizeof header->magic) == 0,
+          filename, "not a bloom filter");
+    check(header->version == bloom_file_version, filename,
+          "unsupported version");
+    check(header->policy_id == hash_fn::policy_id
+          && header->n_hashes == hash_fn::n_hashes
+          && header->seed == hash_fn::seed, filename,
+          "built with a different hash policy");
+    check(header->map_size == map_size, filename, "map size mismatch");
+    check(length == sizeof *header + ((map_size + 63) / 64) * sizeof(uint64_t),
+          filename, "file is truncated");
+
+    map = reinterpret_cast<const uint64_t *>(header + 1);
+  }
+
+  ~mapped_bloom_filter()
+  {
+    munmap(base, length);
+  }
+
+  bool lookup(const string& word) const
+  {
+    hash_list h = hashes(word);
+    for(hash_list::const_iterator i = h.begin(); i != h.end(); i++) {
+      if(!test(*i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  unsigned int saturation() const
+  {
+    unsigned long long count = 0;
+    for(size_t i = 0; i < (map_size + 63) / 64; i++) {
+      count += __builtin_popcountll(map[i]);
+    }
+    return (count * 100) / map_size;
+  }
+
+  const uint64_t *words() const
+  {
+    return map;
+  }
+
+  hash_list::value_type get_map_size() const
+  {
+    return ms;
+  }
+
+  const string& get_hash_name() const
+  {
+    return hashes.get_name();
+  }
+};
+
+template <class hash_fn,
+          typename hash_list::value_type map_size>
+const hash_list::value_type
+mapped_bloom_filter<hash_fn, map_size>::ms = map_size;
+
 class split_into_chars
 {
   static const string name;
 
  public:
   static const hash_list::value_type map_size;
+  static const uint32_t policy_id = 1;
+  static const uint32_t n_hashes = 0; // One per character
+  static const uint32_t seed = 0;
 
   hash_list operator()(const string& word) const
   {
@@ -160,6 +616,9 @@ class char_pairs
 
  public:
   static const hash_list::value_type map_size;
+  static const uint32_t policy_id = 2;
+  static const uint32_t n_hashes = 0; // One per pair of characters
+  static const uint32_t seed = 0;
 
   hash_list operator()(const string& word) const
   {
@@ -183,6 +642,192 @@ class char_pairs
 const hash_list::value_type char_pairs::map_size = 65536;
 const string char_pairs::name = "char_pairs";
 
+// Multi-buffer MD5: hashes up to lanes messages at once, one in each lane
+// of a SIMD vector, using GCC's vector extensions (so it becomes SSE2 or
+// AVX2 as the target allows).  Messages needing different numbers of
+// 64-byte blocks are handled by masking: a lane whose message has run out
+// of blocks keeps its state.  Produces the same digests as OpenSSL's MD5.
+class md5_multi
+{
+ public:
+  static const unsigned int lanes = 8;
+
+ private:
+  typedef uint32_t vec __attribute__((vector_size(lanes * sizeof(uint32_t))));
+
+  // Fill out with bytes [64 * block, 64 * (block + 1)) of word's padded
+  // message: the word, 0x80, zeros, then the length in bits, read as
+  // sixteen little-endian words whatever the host's byte order.
+  static void fill_block(const string& word, size_t block, uint32_t out[16])
+  {
+    unsigned char bytes[64];
+    fill_bytes(word, block, bytes);
+    for(unsigned int i = 0; i < 16; i++) {
+      out[i] = uint32_t(bytes[4 * i]) | uint32_t(bytes[4 * i + 1]) << 8
+        | uint32_t(bytes[4 * i + 2]) << 16 | uint32_t(bytes[4 * i + 3]) << 24;
+    }
+  }
+
+  static void fill_bytes(const string& word, size_t block,
+                         unsigned char out[64])
+  {
+    const size_t len = word.size();
+    const size_t begin = block * 64;
+    memset(out, 0, 64);
+    if(begin < len) {
+      memcpy(out, word.data() + begin, min<size_t>(len - begin, 64));
+    }
+    if(len >= begin && len < begin + 64) {
+      out[len - begin] = 0x80;
+    }
+    if(block + 1 == n_blocks(word)) {
+      const uint64_t bits = uint64_t(len) << 3;
+      for(unsigned int i = 0; i < 8; i++) {
+        out[56 + i] = static_cast<unsigned char>(bits >> (i << 3));
+      }
+    }
+  }
+
+  static size_t n_blocks(const string& word)
+  {
+    return (word.size() + 8) / 64 + 1;
+  }
+
+ public:
+  static void digest(const string *words, unsigned int n,
+                     unsigned char out[][MD5_DIGEST_LENGTH])
+  {
+    size_t max_blocks = 0;
+    for(unsigned int l = 0; l < n; l++) {
+      max_blocks = max(max_blocks, n_blocks(words[l]));
+    }
+
+    vec a0, b0, c0, d0;
+    for(unsigned int l = 0; l < lanes; l++) {
+      a0[l] = 0x67452301;
+      b0[l] = 0xefcdab89;
+      c0[l] = 0x98badcfe;
+      d0[l] = 0x10325476;
+    }
+
+    for(size_t block = 0; block < max_blocks; block++) {
+      // Transpose this block of each message into one vector per 32-bit
+      // word of the block.
+      uint32_t transposed[16][lanes];
+      uint32_t active_lanes[lanes];
+      for(unsigned int l = 0; l < lanes; l++) {
+        uint32_t buf[16];
+        const bool active = l < n && block < n_blocks(words[l]);
+        active_lanes[l] = active ? ~0U : 0;
+        if(active) {
+          fill_block(words[l], block, buf);
+        } else {
+          memset(buf, 0, sizeof buf);
+        }
+        for(unsigned int i = 0; i < 16; i++) {
+          transposed[i][l] = buf[i];
+        }
+      }
+      vec w[16], active;
+      memcpy(w, transposed, sizeof w);
+      memcpy(&active, active_lanes, sizeof active);
+
+      // The 64 steps of RFC 1321, unrolled.  The rotation is written out
+      // in the step rather than in a function, since passing a vector wider
+      // than the target's registers by value changes the ABI.
+      vec a = a0, b = b0, c = c0, d = d0, t;
+#define F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define G(x, y, z) (((x) & (z)) | ((y) & ~(z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define MD5_STEP(f, a, b, c, d, x, k, s) \
+      t = (a) + f((b), (c), (d)) + (x) + (k); \
+      (a) = (b) + ((t << (s)) | (t >> (32 - (s))))
+      MD5_STEP(F, a, b, c, d, w[ 0], 0xd76aa478,  7);
+      MD5_STEP(F, d, a, b, c, w[ 1], 0xe8c7b756, 12);
+      MD5_STEP(F, c, d, a, b, w[ 2], 0x242070db, 17);
+      MD5_STEP(F, b, c, d, a, w[ 3], 0xc1bdceee, 22);
+      MD5_STEP(F, a, b, c, d, w[ 4], 0xf57c0faf,  7);
+      MD5_STEP(F, d, a, b, c, w[ 5], 0x4787c62a, 12);
+      MD5_STEP(F, c, d, a, b, w[ 6], 0xa8304613, 17);
+      MD5_STEP(F, b, c, d, a, w[ 7], 0xfd469501, 22);
+      MD5_STEP(F, a, b, c, d, w[ 8], 0x698098d8,  7);
+      MD5_STEP(F, d, a, b, c, w[ 9], 0x8b44f7af, 12);
+      MD5_STEP(F, c, d, a, b, w[10], 0xffff5bb1, 17);
+      MD5_STEP(F, b, c, d, a, w[11], 0x895cd7be, 22);
+      MD5_STEP(F, a, b, c, d, w[12], 0x6b901122,  7);
+      MD5_STEP(F, d, a, b, c, w[13], 0xfd987193, 12);
+      MD5_STEP(F, c, d, a, b, w[14], 0xa679438e, 17);
+      MD5_STEP(F, b, c, d, a, w[15], 0x49b40821, 22);
+      MD5_STEP(G, a, b, c, d, w[ 1], 0xf61e2562,  5);
+      MD5_STEP(G, d, a, b, c, w[ 6], 0xc040b340,  9);
+      MD5_STEP(G, c, d, a, b, w[11], 0x265e5a51, 14);
+      MD5_STEP(G, b, c, d, a, w[ 0], 0xe9b6c7aa, 20);
+      MD5_STEP(G, a, b, c, d, w[ 5], 0xd62f105d,  5);
+      MD5_STEP(G, d, a, b, c, w[10], 0x02441453,  9);
+      MD5_STEP(G, c, d, a, b, w[15], 0xd8a1e681, 14);
+      MD5_STEP(G, b, c, d, a, w[ 4], 0xe7d3fbc8, 20);
+      MD5_STEP(G, a, b, c, d, w[ 9], 0x21e1cde6,  5);
+      MD5_STEP(G, d, a, b, c, w[14], 0xc33707d6,  9);
+      MD5_STEP(G, c, d, a, b, w[ 3], 0xf4d50d87, 14);
+      MD5_STEP(G, b, c, d, a, w[ 8], 0x455a14ed, 20);
+      MD5_STEP(G, a, b, c, d, w[13], 0xa9e3e905,  5);
+      MD5_STEP(G, d, a, b, c, w[ 2], 0xfcefa3f8,  9);
+      MD5_STEP(G, c, d, a, b, w[ 7], 0x676f02d9, 14);
+      MD5_STEP(G, b, c, d, a, w[12], 0x8d2a4c8a, 20);
+      MD5_STEP(H, a, b, c, d, w[ 5], 0xfffa3942,  4);
+      MD5_STEP(H, d, a, b, c, w[ 8], 0x8771f681, 11);
+      MD5_STEP(H, c, d, a, b, w[11], 0x6d9d6122, 16);
+      MD5_STEP(H, b, c, d, a, w[14], 0xfde5380c, 23);
+      MD5_STEP(H, a, b, c, d, w[ 1], 0xa4beea44,  4);
+      MD5_STEP(H, d, a, b, c, w[ 4], 0x4bdecfa9, 11);
+      MD5_STEP(H, c, d, a, b, w[ 7], 0xf6bb4b60, 16);
+      MD5_STEP(H, b, c, d, a, w[10], 0xbebfbc70, 23);
+      MD5_STEP(H, a, b, c, d, w[13], 0x289b7ec6,  4);
+      MD5_STEP(H, d, a, b, c, w[ 0], 0xeaa127fa, 11);
+      MD5_STEP(H, c, d, a, b, w[ 3], 0xd4ef3085, 16);
+      MD5_STEP(H, b, c, d, a, w[ 6], 0x04881d05, 23);
+      MD5_STEP(H, a, b, c, d, w[ 9], 0xd9d4d039,  4);
+      MD5_STEP(H, d, a, b, c, w[12], 0xe6db99e5, 11);
+      MD5_STEP(H, c, d, a, b, w[15], 0x1fa27cf8, 16);
+      MD5_STEP(H, b, c, d, a, w[ 2], 0xc4ac5665, 23);
+      MD5_STEP(I, a, b, c, d, w[ 0], 0xf4292244,  6);
+      MD5_STEP(I, d, a, b, c, w[ 7], 0x432aff97, 10);
+      MD5_STEP(I, c, d, a, b, w[14], 0xab9423a7, 15);
+      MD5_STEP(I, b, c, d, a, w[ 5], 0xfc93a039, 21);
+      MD5_STEP(I, a, b, c, d, w[12], 0x655b59c3,  6);
+      MD5_STEP(I, d, a, b, c, w[ 3], 0x8f0ccc92, 10);
+      MD5_STEP(I, c, d, a, b, w[10], 0xffeff47d, 15);
+      MD5_STEP(I, b, c, d, a, w[ 1], 0x85845dd1, 21);
+      MD5_STEP(I, a, b, c, d, w[ 8], 0x6fa87e4f,  6);
+      MD5_STEP(I, d, a, b, c, w[15], 0xfe2ce6e0, 10);
+      MD5_STEP(I, c, d, a, b, w[ 6], 0xa3014314, 15);
+      MD5_STEP(I, b, c, d, a, w[13], 0x4e0811a1, 21);
+      MD5_STEP(I, a, b, c, d, w[ 4], 0xf7537e82,  6);
+      MD5_STEP(I, d, a, b, c, w[11], 0xbd3af235, 10);
+      MD5_STEP(I, c, d, a, b, w[ 2], 0x2ad7d2bb, 15);
+      MD5_STEP(I, b, c, d, a, w[ 9], 0xeb86d391, 21);
+#undef MD5_STEP
+#undef I
+#undef H
+#undef G
+#undef F
+
+      a0 += a & active;
+      b0 += b & active;
+      c0 += c & active;
+      d0 += d & active;
+    }
+
+    for(unsigned int l = 0; l < n; l++) {
+      const uint32_t h[4] = { a0[l], b0[l], c0[l], d0[l] };
+      for(unsigned int i = 0; i < 16; i++) {
+        out[l][i] = static_cast<unsigned char>(h[i / 4] >> ((i % 4) << 3));
+      }
+    }
+  }
+};
+
 template <hash_list::value_type hash_bits = 16>
 class md5_hash
 {
@@ -194,15 +839,51 @@ class md5_hash
 
  public:
   static const hash_list::value_type map_size;
+  static const uint32_t policy_id = 3;
+  // At most; a trailing zero hash is dropped.
+  static const uint32_t n_hashes = (128 + hash_bits - 1) / hash_bits;
+  static const uint32_t seed = 0;
 
   hash_list operator()(const string& word) const
   {
-    const unsigned int md5_len = 16; // bytes
-    unsigned char hash[md5_len + (hash_bits >> 3) + 1] = {0};
+    unsigned char digest[MD5_DIGEST_LENGTH];
     MD5_CTX context;
     MD5_Init(&context);
     MD5_Update(&context, word.c_str(), word.size());
-    MD5_Final(hash, &context);
+    MD5_Final(digest, &context);
+    hash_list h;
+    split(digest, h);
+    return h;
+  }
+
+  // Hash n words at once, several at a time with md5_multi, leaving the
+  // hashes of words[i] in out[i] (reusing its storage).  Gives exactly the
+  // same hashes as hashing each word on its own.
+  void operator()(const string *words, size_t n, hash_list *out) const
+  {
+    unsigned char digests[md5_multi::lanes][MD5_DIGEST_LENGTH];
+    for(size_t i = 0; i < n; i += md5_multi::lanes) {
+      const unsigned int batch
+        = min<size_t>(n - i, md5_multi::lanes);
+      md5_multi::digest(words + i, batch, digests);
+      for(unsigned int j = 0; j < batch; j++) {
+        split(digests[j], out[i + j]);
+      }
+    }
+  }
+
+  const string& get_name() const 
+  {
+    return name;
+  }
+
+ private:
+  // Split an MD5 digest into hash_bits-sized hashes.
+  void split(const unsigned char *digest, hash_list& h) const
+  {
+    const unsigned int md5_len = 16; // bytes
+    unsigned char hash[md5_len + (hash_bits >> 3) + 1] = {0};
+    memcpy(hash, digest, md5_len);
 
 #if 0
     clog << "hash = 0x";
@@ -213,7 +894,7 @@ class md5_hash
     clog << endl;
 #endif
 
-    hash_list h;
+    h.clear();
     for(unsigned int start_bit = 0; start_bit < (md5_len << 3);
         start_bit += hash_bits) {
       const unsigned int start_byte = start_bit >> 3;
@@ -256,12 +937,6 @@ class md5_hash
     clog << endl;
 #endif
 
-    return h;
-  }
-
-  const string& get_name() const 
-  {
-    return name;
   }
 };
 
@@ -270,58 +945,1223 @@ const hash_list::value_type md5_hash<hash_bits>::map_size = (1 << hash_bits);
 template <hash_list::value_type hash_bits>
 const string md5_hash<hash_bits>::name = "md5_hash";
 
-/////////////////
-// Test functions
-/////////////////
+// A cuckoo filter: each word is reduced to a small fingerprint, stored in
+// one of two candidate buckets of bucket_size slots.  Unlike the bloom
+// filter, words can be erased again.  The false positive rate is roughly
+// 2 * bucket_size / 2^(bits in fingerprint), so 8-bit fingerprints give
+// about 3% and 16-bit ones about 0.01%.  A bucket is bucket_size
+// fingerprints in one aligned block, so no bucket straddles a cache line
+// and a lookup touches at most two.
+template <typename fingerprint = uint16_t>
+class cuckoo_filter
+{
+  static const string name;
+  static const unsigned int bucket_size = 4;
+  static const unsigned int max_kicks = 500;
+  // Percentage of slots which can reliably be filled.  With only 255
+  // possible 8-bit fingerprints there are few alternate buckets to kick
+  // to, so they can't pack as tightly.
+  static const unsigned int max_load = sizeof(fingerprint) > 1 ? 95 : 90;
+
+  vector<fingerprint> table;
+  uint64_t n_buckets;
+  size_t n_items;
+
+  // When an insert runs out of kicks, the fingerprint left homeless is
+  // kept here rather than lost.  The filter is full while it's in use.
+  bool victim_used;
+  fingerprint victim_fp;
+  uint64_t victim_bucket;
+
+  void hash(const string& word, uint64_t& bucket, fingerprint& fp) const
+  {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5(reinterpret_cast<const unsigned char *>(word.data()), word.size(),
+        digest);
+    uint64_t h1, h2;
+    memcpy(&h1, digest, sizeof h1);
+    memcpy(&h2, digest + sizeof h1, sizeof h2);
+
+    bucket = h1 % n_buckets;
+    // Zero marks an empty slot, so never use it as a fingerprint.
+    fp = static_cast<fingerprint>(h2 % fingerprint(~fingerprint(0))) + 1;
+  }
+
+  // The alternate bucket depends only on the current bucket and the
+  // fingerprint, so a fingerprint can be moved without the original word.
+  // (h - bucket) mod n maps each bucket of the pair to the other, without
+  // needing the number of buckets to be a power of two.
+  uint64_t alt_bucket(uint64_t bucket, fingerprint fp) const
+  {
+    const uint64_t h = (uint64_t(fp) * 0x5bd1e995) % n_buckets;
+    return (h + n_buckets - bucket) % n_buckets;
+  }
+
+  bool contains(uint64_t bucket, fingerprint fp) const
+  {
+    const fingerprint *b = &table[bucket * bucket_size];
+    bool found = false;
+    for(unsigned int i = 0; i < bucket_size; i++) {
+      found |= (b[i] == fp);
+    }
+    return found;
+  }
+
+  bool add(uint64_t bucket, fingerprint fp)
+  {
+    fingerprint *b = &table[bucket * bucket_size];
+    for(unsigned int i = 0; i < bucket_size; i++) {
+      if(b[i] == 0) {
+        b[i] = fp;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool remove(uint64_t bucket, fingerprint fp)
+  {
+    fingerprint *b = &table[bucket * bucket_size];
+    for(unsigned int i = 0; i < bucket_size; i++) {
+      if(b[i] == fp) {
+        b[i] = 0;
+        return true;
+      }
+    }
+    return false;
+  }
+
+ public:
+  // Sized so that capacity words fill the table to max_load.
+  cuckoo_filter(size_t capacity)
+    : n_buckets((uint64_t(capacity) * 100 + bucket_size * max_load - 1)
+                / (bucket_size * max_load)),
+      n_items(0), victim_used(false), victim_fp(0), victim_bucket(0)
+  {
+    if(n_buckets == 0) {
+      n_buckets = 1;
+    }
+    table.assign(n_buckets * bucket_size, 0);
+  }
+
+  // Returns false if the filter is too full to take the word.
+  bool insert(const string& word)
+  {
+    if(victim_used) {
+      return false;
+    }
+    uint64_t bucket;
+    fingerprint fp;
+    hash(word, bucket, fp);
+    n_items++;
+    if(add(bucket, fp) || add(alt_bucket(bucket, fp), fp)) {
+      return true;
+    }
+
+    if(rand() % 2) {
+      bucket = alt_bucket(bucket, fp);
+    }
+    for(unsigned int kick = 0; kick < max_kicks; kick++) {
+      swap(fp, table[bucket * bucket_size + rand() % bucket_size]);
+      bucket = alt_bucket(bucket, fp);
+      if(add(bucket, fp)) {
+        return true;
+      }
+    }
+    victim_used = true;
+    victim_fp = fp;
+    victim_bucket = bucket;
+    return true;
+  }
+
+  void load_dictionary(const string& dictfile)
+  {
+    ifstream d(dictfile.c_str());
+    string line;
+    while(getline(d, line)) {
+      insert(line);
+    }
+  }
+
+  bool lookup(const string& word) const
+  {
+    uint64_t bucket;
+    fingerprint fp;
+    hash(word, bucket, fp);
+    const uint64_t alt = alt_bucket(bucket, fp);
+    if(victim_used && victim_fp == fp
+       && (victim_bucket == bucket || victim_bucket == alt)) {
+      return true;
+    }
+    return contains(bucket, fp) || contains(alt, fp);
+  }
+
+  // Only erase words which have actually been inserted, otherwise a
+  // false positive may take out another word's fingerprint.
+  bool erase(const string& word)
+  {
+    uint64_t bucket;
+    fingerprint fp;
+    hash(word, bucket, fp);
+    const uint64_t alt = alt_bucket(bucket, fp);
+    if(victim_used && victim_fp == fp
+       && (victim_bucket == bucket || victim_bucket == alt)) {
+      victim_used = false;
+    } else if(!remove(bucket, fp) && !remove(alt, fp)) {
+      return false;
+    }
+    n_items--;
+
+    // Now there may be room, try to find the victim a home again.
+    if(victim_used && (add(victim_bucket, victim_fp)
+                       || add(alt_bucket(victim_bucket, victim_fp),
+                              victim_fp))) {
+      victim_used = false;
+    }
+    return true;
+  }
+
+  unsigned int saturation() const
+  {
+    return (n_items * 100) / table.size();
+  }
+
+  size_t size() const
+  {
+    return n_items;
+  }
+
+  size_t memory_used() const
+  {
+    return table.size() * sizeof(fingerprint);
+  }
+
+  double bits_per_key() const
+  {
+    return n_items ? (memory_used() * 8.0) / n_items : 0.0;
+  }
+
+  // Upper bound on the false positive rate when the table is full.
+  static double expected_fpr()
+  {
+    return (2.0 * bucket_size) / fingerprint(~fingerprint(0));
+  }
+
+  const string& get_hash_name() const
+  {
+    return name;
+  }
+};
+
+template <typename fingerprint>
+const string cuckoo_filter<fingerprint>::name = "cuckoo_filter";
+
+// Bits per key an optimally configured bloom filter needs for a given
+// false positive rate.
+double bloom_bits_per_key(double fpr)
+{
+  return -log(fpr) / (log(2.0) * log(2.0));
+}
+
+// An immutable xor filter, for a dictionary which is built once and then
+// only ever queried.  Every word maps to three slots, one in each third of
+// the table, and the fingerprints are arranged so that the three slots of
+// each word xor together to its own fingerprint.  A lookup is exactly
+// three memory accesses, the table needs about 1.23 slots per word, and
+// the false positive rate is 2^-(bits in fingerprint).
+template <typename fingerprint = uint8_t>
+class xor_filter
+{
+  static const string name;
+
+  // Seeds to try before giving up; each fails with probability well
+  // under one half.
+  static const unsigned int max_attempts = 100;
+
+  vector<fingerprint> fingerprints;
+  uint64_t block_length;
+  uint64_t seed;
+  size_t n_keys;
+
+  // The MD5 of a word is only taken once; retries with a new seed just
+  // remix it.
+  static uint64_t key_of(const string& word)
+  {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5(reinterpret_cast<const unsigned char *>(word.data()), word.size(),
+        digest);
+    uint64_t k;
+    memcpy(&k, digest, sizeof k);
+    return k;
+  }
+
+  // MurmurHash3's 64-bit finaliser.
+  static uint64_t mix(uint64_t h)
+  {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  static uint64_t rotl(uint64_t x, unsigned int r)
+  {
+    return r ? (x << r) | (x >> (64 - r)) : x;
+  }
+
+  uint64_t slot(uint64_t hash, unsigned int i) const
+  {
+    const uint64_t r = rotl(hash, i * 21) & 0xffffffffULL;
+    return ((r * block_length) >> 32) + i * block_length;
+  }
+
+  static fingerprint fingerprint_of(uint64_t hash)
+  {
+    return static_cast<fingerprint>(hash ^ (hash >> 32));
+  }
+
+  // Try to arrange the keys with the current seed.  Repeatedly peel off
+  // slots which only one key maps to, recording the order; if every key
+  // gets peeled, assigning fingerprints in reverse order always works.
+  bool construct(const vector<uint64_t>& keys)
+  {
+    const uint64_t capacity = fingerprints.size();
+    vector<uint8_t> count(capacity, 0);
+    vector<uint64_t> hash_xor(capacity, 0);
+
+    for(vector<uint64_t>::const_iterator k = keys.begin();
+        k != keys.end(); k++) {
+      const uint64_t h = mix(*k + seed);
+      for(unsigned int i = 0; i < 3; i++) {
+        const uint64_t s = slot(h, i);
+        if(++count[s] == 0) {
+          return false; // Too many keys in one slot; try another seed.
+        }
+        hash_xor[s] ^= h;
+      }
+    }
+
+    vector<uint64_t> queue;
+    for(uint64_t s = 0; s < capacity; s++) {
+      if(count[s] == 1) {
+        queue.push_back(s);
+      }
+    }
+
+    vector<pair<uint64_t, uint64_t> > peeled; // (hash, slot)
+    peeled.reserve(keys.size());
+    while(!queue.empty()) {
+      const uint64_t s = queue.back();
+      queue.pop_back();
+      if(count[s] != 1) {
+        continue;
+      }
+      const uint64_t h = hash_xor[s];
+      peeled.push_back(make_pair(h, s));
+      for(unsigned int i = 0; i < 3; i++) {
+        const uint64_t t = slot(h, i);
+        count[t]--;
+        hash_xor[t] ^= h;
+        if(count[t] == 1) {
+          queue.push_back(t);
+        }
+      }
+    }
+    if(peeled.size() != keys.size()) {
+      return false;
+    }
+
+    fill(fingerprints.begin(), fingerprints.end(), 0);
+    for(vector<pair<uint64_t, uint64_t> >::reverse_iterator p
+          = peeled.rbegin(); p != peeled.rend(); p++) {
+      const uint64_t h = p->first;
+      fingerprints[p->second] = fingerprint_of(h)
+        ^ fingerprints[slot(h, 0)] ^ fingerprints[slot(h, 1)]
+        ^ fingerprints[slot(h, 2)];
+    }
+    return true;
+  }
+
+ public:
+  xor_filter()
+    : block_length(0), seed(0), n_keys(0)
+  {
+  }
+
+  // Build the filter from the complete set of words.  Duplicates are
+  // fine.  Returns the number of seeds it took, which should rarely be
+  // more than one or two; gives up, throwing, after max_attempts.
+  template <class InputIterator>
+  unsigned int build(InputIterator first, InputIterator last)
+  {
+    vector<uint64_t> keys;
+    for(; first != last; ++first) {
+      keys.push_back(key_of(*first));
+    }
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    n_keys = keys.size();
+
+    block_length = (32 + keys.size() * 123 / 100) / 3;
+    fingerprints.assign(block_length * 3, 0);
+
+    unsigned int attempts = 0;
+    seed = 0x9e3779b97f4a7c15ULL;
+    do {
+      if(attempts == max_attempts) {
+        fingerprints.clear();
+        n_keys = 0;
+        throw runtime_error("Unable to build xor filter: no seed works");
+      }
+      seed = mix(seed + attempts);
+      attempts++;
+    } while(!construct(keys));
+    return attempts;
+  }
+
+  void load_dictionary(const string& dictfile)
+  {
+    vector<string> words;
+    ifstream d(dictfile.c_str());
+    string line;
+    while(getline(d, line)) {
+      words.push_back(line);
+    }
+    build(words.begin(), words.end());
+  }
+
+  bool lookup(const string& word) const
+  {
+    if(fingerprints.empty()) {
+      return false;
+    }
+    const uint64_t h = mix(key_of(word) + seed);
+    return (fingerprint_of(h) ^ fingerprints[slot(h, 0)]
+            ^ fingerprints[slot(h, 1)] ^ fingerprints[slot(h, 2)]) == 0;
+  }
+
+  size_t size() const
+  {
+    return n_keys;
+  }
+
+  size_t memory_used() const
+  {
+    return fingerprints.size() * sizeof(fingerprint);
+  }
+
+  double bits_per_key() const
+  {
+    return n_keys ? (memory_used() * 8.0) / n_keys : 0.0;
+  }
+
+  static double expected_fpr()
+  {
+    return 1.0 / (double(fingerprint(~fingerprint(0))) + 1);
+  }
+
+  const string& get_hash_name() const
+  {
+    return name;
+  }
+};
+
+template <typename fingerprint>
+const string xor_filter<fingerprint>::name = "xor_filter";
+
+// A bloom filter which grows to take however many words it's given.  It
+// is a chain of layers, each a plain bloom filter sized at run time.  Once
+// the newest layer is half full (the point at which an optimally sized
+// bloom filter reaches its designed error rate) a new layer is added
+// with growth times the capacity and tightening times the error rate.
+// The overall false positive rate is then bounded by
+// fpr / (1 - tightening), no matter how many layers there are.
+class scalable_bloom_filter
+{
+  static const string name;
+
+  class layer
+  {
+    vector<uint64_t> map;
+    uint64_t map_size;
+    unsigned int n_hashes;
+    uint64_t bits_set;
+
+    // Kirsch & Mitzenmacher: k hashes from two, with no loss in accuracy.
+    uint64_t bit(uint64_t h1, uint64_t h2, unsigned int i) const
+    {
+      return (h1 + i * h2) % map_size;
+    }
+
+  public:
+    layer(size_t capacity, double fpr)
+      : map_size(static_cast<uint64_t>(ceil(capacity * -log(fpr)
+                                            / (log(2.0) * log(2.0))))),
+        n_hashes(static_cast<unsigned int>(ceil(-log(fpr) / log(2.0)))),
+        bits_set(0)
+    {
+      if(map_size < 64) {
+        map_size = 64;
+      }
+      map.assign((map_size + 63) / 64, 0);
+    }
+
+    void insert(uint64_t h1, uint64_t h2)
+    {
+      for(unsigned int i = 0; i < n_hashes; i++) {
+        const uint64_t b = bit(h1, h2, i);
+        uint64_t& w = map[b / 64];
+        const uint64_t mask = uint64_t(1) << (b % 64);
+        bits_set += !(w & mask);
+        w |= mask;
+      }
+    }
+
+    bool lookup(uint64_t h1, uint64_t h2) const
+    {
+      for(unsigned int i = 0; i < n_hashes; i++) {
+        const uint64_t b = bit(h1, h2, i);
+        if(!(map[b / 64] & (uint64_t(1) << (b % 64)))) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    unsigned int saturation() const
+    {
+      return (bits_set * 100) / map_size;
+    }
+
+    size_t memory_used() const
+    {
+      return map.size() * sizeof(uint64_t);
+    }
+  };
+
+  vector<layer> layers;
+  size_t next_capacity;
+  double next_fpr;
+  const double initial_fpr;
+  const unsigned int growth;
+  const double tightening;
+  size_t n_items;
+
+  static void hash(const string& word, uint64_t& h1, uint64_t& h2)
+  {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5(reinterpret_cast<const unsigned char *>(word.data()), word.size(),
+        digest);
+    memcpy(&h1, digest, sizeof h1);
+    memcpy(&h2, digest + sizeof h1, sizeof h2);
+    h2 |= 1; // Never step by zero.
+  }
+
+  void add_layer()
+  {
+    layers.push_back(layer(next_capacity, next_fpr));
+    next_capacity *= growth;
+    next_fpr *= tightening;
+  }
+
+ public:
+  scalable_bloom_filter(size_t initial_capacity = 1024, double fpr = 0.001,
+                        unsigned int growth = 2, double tightening = 0.5)
+    : next_capacity(initial_capacity), next_fpr(fpr), initial_fpr(fpr),
+      growth(growth), tightening(tightening), n_items(0)
+  {
+    add_layer();
+  }
+
+  void insert(const string& word)
+  {
+    uint64_t h1, h2;
+    hash(word, h1, h2);
+    if(layers.back().saturation() >= 50) {
+      add_layer();
+    }
+    layers.back().insert(h1, h2);
+    n_items++;
+  }
+
+  void load_dictionary(const string& dictfile)
+  {
+    ifstream d(dictfile.c_str());
+    string line;
+    while(getline(d, line)) {
+      insert(line);
+    }
+  }
+
+  // Check the newest layer first: it is the largest, and holds the most
+  // recently added (and, for most streams, most often queried) words.
+  bool lookup(const string& word) const
+  {
+    uint64_t h1, h2;
+    hash(word, h1, h2);
+    for(vector<layer>::const_reverse_iterator i = layers.rbegin();
+        i != layers.rend(); i++) {
+      if(i->lookup(h1, h2)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Saturation of the layer currently being filled.
+  unsigned int saturation() const
+  {
+    return layers.back().saturation();
+  }
+
+  size_t n_layers() const
+  {
+    return layers.size();
+  }
+
+  size_t size() const
+  {
+    return n_items;
+  }
+
+  size_t memory_used() const
+  {
+    size_t total = 0;
+    for(vector<layer>::const_iterator i = layers.begin();
+        i != layers.end(); i++) {
+      total += i->memory_used();
+    }
+    return total;
+  }
+
+  double bits_per_key() const
+  {
+    return n_items ? (memory_used() * 8.0) / n_items : 0.0;
+  }
+
+  double expected_fpr() const
+  {
+    return initial_fpr / (1 - tightening);
+  }
+
+  const string& get_hash_name() const
+  {
+    return name;
+  }
+};
+
+const string scalable_bloom_filter::name = "scalable_bloom_filter";
+
+// Holds the current version of a filter which is being looked up on many
+// threads while a newer version is built.  publish() swaps in a new
+// filter atomically; readers never take a lock and never see a half-built
+// filter.  The old filter is deleted once every reader which might still
+// be using it has left, using two epoch-indexed reader counts in the
+// style of userspace RCU: the publisher flips the epoch and waits for the
+// count of the previous epoch to drain, twice, so that even a reader
+// which picked up a stale epoch has finished before the delete.
+template <class filter>
+class filter_snapshot : boost::noncopyable
+{
+  filter *current;
+  mutable unsigned long epoch;
+  mutable unsigned long readers[2];
+  boost::mutex publishing;
+
+  void wait_for_readers()
+  {
+    const unsigned long e = __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&readers[e & 1], __ATOMIC_SEQ_CST) != 0) {
+      boost::thread::yield();
+    }
+  }
+
+ public:
+  // Keeps the filter pinned for as long as it's in scope, for callers
+  // wanting several lookups against the same version.
+  class pin : boost::noncopyable
+  {
+    const filter_snapshot& s;
+    unsigned long parity;
+    const filter *f;
+
+  public:
+    pin(const filter_snapshot& s)
+      : s(s),
+        parity(__atomic_load_n(&s.epoch, __ATOMIC_SEQ_CST) & 1)
+    {
+      __atomic_fetch_add(&s.readers[parity], 1, __ATOMIC_SEQ_CST);
+      f = __atomic_load_n(&s.current, __ATOMIC_SEQ_CST);
+    }
+
+    ~pin()
+    {
+      __atomic_fetch_sub(&s.readers[parity], 1, __ATOMIC_SEQ_CST);
+    }
+
+    const filter& operator*() const
+    {
+      return *f;
+    }
+
+    const filter* operator->() const
+    {
+      return f;
+    }
+  };
+
+  // Takes ownership of initial.
+  filter_snapshot(filter *initial)
+    : current(initial), epoch(0)
+  {
+    readers[0] = readers[1] = 0;
+  }
+
+  ~filter_snapshot()
+  {
+    delete current;
+  }
+
+  bool lookup(const string& word) const
+  {
+    return pin(*this)->lookup(word);
+  }
+
+  // Takes ownership of next.  Returns once the previous filter has been
+  // deleted.  Publishers are serialised, but never block readers.
+  void publish(filter *next)
+  {
+    boost::mutex::scoped_lock lock(publishing);
+    filter *old = __atomic_exchange_n(&current, next, __ATOMIC_SEQ_CST);
+    wait_for_readers();
+    wait_for_readers();
+    delete old;
+  }
+
+  // Build a fresh filter from dictfile and publish it.  Typically run on
+  // a background thread while lookups carry on against the old one.
+  void reload(const string& dictfile)
+  {
+    auto_ptr<filter> next(new filter);
+    next->load_dictionary(dictfile);
+    publish(next.release());
+  }
+};
+
+#ifndef KATA5_BENCHMARK
+
+/////////////////
+// Test functions
+/////////////////
+
+template <class hash_fn>
+void test_insert_some_words()
+{
+  bloom_filter<hash_fn> bf;
+  bf.insert("foo");
+  bf.insert("bar");
+  bf.insert("bazification");
+
+  BOOST_MESSAGE(bf.get_hash_name() << " (map_size = " << bf.get_map_size()
+                << ") with 3 entries is "
+                << bf.saturation() << "% full.");
+
+  // Successful lookups
+  BOOST_CHECK(bf.lookup("foo") == true);
+  BOOST_CHECK(bf.lookup("bar") == true);
+  BOOST_CHECK(bf.lookup("bazification") == true);
+
+  // Try some things not in the dictionary
+  BOOST_CHECK(bf.lookup("notindict") == false);
+}
+
+template <class hash_fn>
+void test_dictionary()
+{
+  bloom_filter<hash_fn> bf;
+  bf.load_dictionary(dict);
+  ifstream f(dict.c_str());
+  string word;
+  unsigned int n_words = 0;
+  while(getline(f, word)) {
+    BOOST_CHECK(bf.lookup(word)); // No false negatives!
+    n_words++;
+  }
+
+  BOOST_MESSAGE(bf.get_hash_name() << " (map_size = " << bf.get_map_size()
+                << ") with " << n_words << " entries is "
+                << bf.saturation() << "% full.");
+}
+
+// The threaded load must produce exactly the same map as a serial one.
+template <class hash_fn>
+void test_concurrent_dictionary()
+{
+  bloom_filter<hash_fn> bf;
+  bf.load_dictionary(dict);
+  concurrent_bloom_filter<hash_fn> cbf, serial;
+  cbf.load_dictionary(dict, 4);
+  serial.load_dictionary(dict, 1);
+
+  ifstream f(dict.c_str());
+  string word;
+  unsigned int n_words = 0;
+  while(getline(f, word)) {
+    BOOST_CHECK(cbf.lookup(word));
+    n_words++;
+  }
+  BOOST_CHECK_EQUAL(bf.saturation(), cbf.saturation());
+  BOOST_CHECK(equal(serial.words(),
+                    serial.words() + (serial.get_map_size() + 63) / 64,
+                    cbf.words()));
+
+  BOOST_MESSAGE(cbf.get_hash_name() << " (map_size = " << cbf.get_map_size()
+                << ", concurrent) with " << n_words << " entries is "
+                << cbf.saturation() << "% full.");
+}
+
+template <size_t len>
+string random_word()
+{
+  char word[len + 1] = {0};
+
+  for(unsigned int i = 0; i < len; i++) {
+    word[i] = (rand() % 26) + 'a';
+  }
+  return string(word);
+}
+
+template <class hash_fn>
+void test_save_and_open()
+{
+  const string filename = "kata5.bloom";
+  bloom_filter<hash_fn> bf;
+  bf.load_dictionary(dict);
+  bf.save(filename);
+
+  mapped_bloom_filter<hash_fn> mbf(filename);
+  BOOST_CHECK_EQUAL(bf.saturation(), mbf.saturation());
 
-template <class hash_fn>
-void test_insert_some_words()
+  ifstream f(dict.c_str());
+  string word;
+  while(getline(f, word)) {
+    BOOST_CHECK(mbf.lookup(word));
+  }
+  for(unsigned int i = 0; i < 1000; i++) {
+    string rword = random_word<5>();
+    BOOST_CHECK_EQUAL(bf.lookup(rword), mbf.lookup(rword));
+  }
+
+  BOOST_MESSAGE(mbf.get_hash_name() << " (map_size = " << mbf.get_map_size()
+                << ") reopened from " << filename << " is "
+                << mbf.saturation() << "% full.");
+}
+
+template <typename fingerprint>
+void test_cuckoo_filter()
 {
-  bloom_filter<hash_fn> bf;
-  bf.insert("foo");
-  bf.insert("bar");
-  bf.insert("bazification");
+  cuckoo_filter<fingerprint> cf(100);
+  BOOST_CHECK(cf.insert("foo"));
+  BOOST_CHECK(cf.insert("bar"));
+  BOOST_CHECK(cf.insert("bazification"));
+  BOOST_CHECK_EQUAL(cf.size(), 3U);
 
-  BOOST_MESSAGE(bf.get_hash_name() << " (map_size = " << bf.get_map_size()
-                << ") with 3 entries is "
-                << bf.saturation() << "% full.");
+  BOOST_CHECK(cf.lookup("foo") == true);
+  BOOST_CHECK(cf.lookup("bar") == true);
+  BOOST_CHECK(cf.lookup("bazification") == true);
+  BOOST_CHECK(cf.lookup("notindict") == false);
 
-  // Successful lookups
-  BOOST_CHECK(bf.lookup("foo") == true);
-  BOOST_CHECK(bf.lookup("bar") == true);
-  BOOST_CHECK(bf.lookup("bazification") == true);
+  BOOST_CHECK(cf.erase("bar"));
+  BOOST_CHECK(cf.lookup("bar") == false);
+  BOOST_CHECK(cf.lookup("foo") == true);
+  BOOST_CHECK(!cf.erase("bar"));
+  BOOST_CHECK_EQUAL(cf.size(), 2U);
+}
 
-  // Try some things not in the dictionary
-  BOOST_CHECK(bf.lookup("notindict") == false);
+template <typename fingerprint>
+void test_cuckoo_dictionary()
+{
+  const unsigned int n_tests = 10000;
+
+  set<string> real_dict;
+  ifstream f(dict.c_str());
+  string line;
+  while(getline(f, line)) {
+    real_dict.insert(line);
+  }
+
+  cuckoo_filter<fingerprint> cf(real_dict.size());
+  for(set<string>::const_iterator i = real_dict.begin();
+      i != real_dict.end(); i++) {
+    BOOST_CHECK(cf.insert(*i));
+  }
+  for(set<string>::const_iterator i = real_dict.begin();
+      i != real_dict.end(); i++) {
+    BOOST_CHECK(cf.lookup(*i)); // No false negatives!
+  }
+
+  unsigned int fpos = 0, misses = 0;
+  for(unsigned int i = 0; i < n_tests; i++) {
+    string rword = random_word<8>();
+    if(real_dict.find(rword) == real_dict.end()) {
+      misses++;
+      if(cf.lookup(rword)) {
+        fpos++;
+      }
+    }
+  }
+  const double fpr = misses ? double(fpos) / misses : 0.0;
+
+  BOOST_MESSAGE(cf.get_hash_name() << " (" << (sizeof(fingerprint) << 3)
+                << "-bit fingerprints) with " << cf.size()
+                << " entries is " << cf.saturation() << "% full, "
+                << cf.bits_per_key() << " bits/key.\n  "
+                << fpos << " false positives in " << misses
+                << " lookups, a rate of " << fpr << " (expected "
+                << cf.expected_fpr() << "); a bloom filter needs "
+                << bloom_bits_per_key(cf.expected_fpr())
+                << " bits/key for the same rate.");
+  BOOST_CHECK(fpr < 2 * cf.expected_fpr() + 0.01);
+
+  // Erase half the dictionary, and the rest must still be there.
+  unsigned int n = 0;
+  for(set<string>::const_iterator i = real_dict.begin();
+      i != real_dict.end(); i++, n++) {
+    if(n % 2) {
+      BOOST_CHECK(cf.erase(*i));
+    }
+  }
+  n = 0;
+  for(set<string>::const_iterator i = real_dict.begin();
+      i != real_dict.end(); i++, n++) {
+    if(!(n % 2)) {
+      BOOST_CHECK(cf.lookup(*i));
+    }
+  }
+}
+
+template <typename fingerprint>
+void test_xor_filter()
+{
+  const string l[] = { "foo", "bar", "bazification", "foo" };
+  xor_filter<fingerprint> xf;
+  BOOST_CHECK(xf.lookup("foo") == false);
+  xf.build(l, l + sizeof l / sizeof *l);
+  BOOST_CHECK_EQUAL(xf.size(), 3U);
+
+  BOOST_CHECK(xf.lookup("foo") == true);
+  BOOST_CHECK(xf.lookup("bar") == true);
+  BOOST_CHECK(xf.lookup("bazification") == true);
+}
+
+template <typename fingerprint>
+void test_xor_dictionary()
+{
+  const unsigned int n_tests = 10000;
+
+  set<string> real_dict;
+  ifstream f(dict.c_str());
+  string line;
+  while(getline(f, line)) {
+    real_dict.insert(line);
+  }
+
+  xor_filter<fingerprint> xf;
+  const unsigned int attempts = xf.build(real_dict.begin(), real_dict.end());
+  for(set<string>::const_iterator i = real_dict.begin();
+      i != real_dict.end(); i++) {
+    BOOST_CHECK(xf.lookup(*i)); // No false negatives!
+  }
+
+  unsigned int fpos = 0, misses = 0;
+  for(unsigned int i = 0; i < n_tests; i++) {
+    string rword = random_word<8>();
+    if(real_dict.find(rword) == real_dict.end()) {
+      misses++;
+      if(xf.lookup(rword)) {
+        fpos++;
+      }
+    }
+  }
+
+  BOOST_MESSAGE(xf.get_hash_name() << " (" << (sizeof(fingerprint) << 3)
+                << "-bit fingerprints) with " << xf.size()
+                << " entries, built with " << attempts << " seed(s), uses "
+                << xf.bits_per_key() << " bits/key.\n  "
+                << fpos << " false positives in " << misses
+                << " lookups (expected rate " << xf.expected_fpr()
+                << "); a bloom filter needs "
+                << bloom_bits_per_key(xf.expected_fpr())
+                << " bits/key for the same rate.");
+}
+
+void test_scalable_bloom_filter()
+{
+  const unsigned int n_tests = 10000;
+
+  set<string> real_dict;
+  ifstream f(dict.c_str());
+  string line;
+  while(getline(f, line)) {
+    real_dict.insert(line);
+  }
+
+  // Deliberately start far too small for the dictionary.
+  scalable_bloom_filter sbf(1000, 0.001);
+  for(set<string>::const_iterator i = real_dict.begin();
+      i != real_dict.end(); i++) {
+    sbf.insert(*i);
+  }
+  for(set<string>::const_iterator i = real_dict.begin();
+      i != real_dict.end(); i++) {
+    BOOST_CHECK(sbf.lookup(*i)); // No false negatives!
+  }
+
+  unsigned int fpos = 0, misses = 0;
+  for(unsigned int i = 0; i < n_tests; i++) {
+    string rword = random_word<8>();
+    if(real_dict.find(rword) == real_dict.end()) {
+      misses++;
+      if(sbf.lookup(rword)) {
+        fpos++;
+      }
+    }
+  }
+  // Allow plenty of slack for the randomness of a 10,000 word sample.
+  BOOST_CHECK(fpos <= 3 * sbf.expected_fpr() * misses + 5);
+
+  BOOST_MESSAGE(sbf.get_hash_name() << " with " << sbf.size()
+                << " entries has grown to " << sbf.n_layers()
+                << " layers, using " << sbf.bits_per_key() << " bits/key.\n  "
+                << fpos << " false positives in " << misses
+                << " lookups (bound " << sbf.expected_fpr() << ").");
+}
+
+// Readers hammering a snapshot while new versions are published must
+// always find a word which is in every version.
+struct snapshot_reader
+{
+  const filter_snapshot<bloom_filter<md5_hash<16> > >& s;
+  const int& stop;
+  unsigned long& misses;
+
+  snapshot_reader(const filter_snapshot<bloom_filter<md5_hash<16> > >& s,
+                  const int& stop, unsigned long& misses)
+    : s(s), stop(stop), misses(misses)
+  {
+  }
+
+  void operator()()
+  {
+    while(!__atomic_load_n(&stop, __ATOMIC_SEQ_CST)) {
+      if(!s.lookup("foo")) {
+        __atomic_fetch_add(&misses, 1, __ATOMIC_SEQ_CST);
+      }
+    }
+  }
+};
+
+void test_filter_snapshot()
+{
+  typedef bloom_filter<md5_hash<16> > filter;
+  filter *first = new filter;
+  first->insert("foo");
+  filter_snapshot<filter> s(first);
+  BOOST_CHECK(s.lookup("foo"));
+  BOOST_CHECK(!s.lookup("bar"));
+
+  int stop = 0;
+  unsigned long misses = 0;
+  boost::thread_group readers;
+  for(unsigned int i = 0; i < 4; i++) {
+    readers.create_thread(snapshot_reader(s, stop, misses));
+  }
+
+  for(unsigned int i = 0; i < 100; i++) {
+    filter *next = new filter;
+    next->insert("foo");
+    next->insert("bar");
+    s.publish(next);
+  }
+  __atomic_store_n(&stop, 1, __ATOMIC_SEQ_CST);
+  readers.join_all();
+
+  BOOST_CHECK_EQUAL(misses, 0UL);
+  BOOST_CHECK(s.lookup("bar"));
+
+  {
+    filter_snapshot<filter>::pin p(s);
+    BOOST_CHECK(p->lookup("foo"));
+    BOOST_CHECK_EQUAL(p->get_map_size(), 65536U);
+  }
+  s.reload(dict);
+  ifstream f(dict.c_str());
+  string word;
+  while(getline(f, word)) {
+    BOOST_CHECK(s.lookup(word));
+  }
+}
+
+// Split the dictionary into n_shards files, a line at a time.
+vector<string> write_shards(unsigned int n_shards)
+{
+  vector<string> names;
+  vector<ofstream *> shards;
+  for(unsigned int i = 0; i < n_shards; i++) {
+    names.push_back("kata5.shard" + boost::lexical_cast<string>(i));
+    shards.push_back(new ofstream(names.back().c_str()));
+  }
+  ifstream f(dict.c_str());
+  string word;
+  for(unsigned int n = 0; getline(f, word); n++) {
+    *shards[n % n_shards] << word << "\n";
+  }
+  for(unsigned int i = 0; i < n_shards; i++) {
+    delete shards[i];
+  }
+  return names;
 }
 
 template <class hash_fn>
-void test_dictionary()
+void test_sharded_union()
 {
-  bloom_filter<hash_fn> bf;
-  bf.load_dictionary(dict);
+  concurrent_bloom_filter<hash_fn> whole;
+  whole.load_dictionary(dict, 1);
+
+  concurrent_bloom_filter<hash_fn> merged;
+  const vector<string> shards = write_shards(4);
+  merged.load_shards(shards);
+  BOOST_CHECK(equal(whole.words(),
+                    whole.words() + (whole.get_map_size() + 63) / 64,
+                    merged.words()));
+
+  // As if the shards had come from other processes.
+  concurrent_bloom_filter<hash_fn> from_files;
+  for(size_t i = 0; i < shards.size(); i++) {
+    concurrent_bloom_filter<hash_fn> shard;
+    shard.load_dictionary(shards[i], 1);
+    shard.save("kata5.bloom");
+    from_files.merge_union(mapped_bloom_filter<hash_fn>("kata5.bloom"));
+  }
+  BOOST_CHECK(equal(whole.words(),
+                    whole.words() + (whole.get_map_size() + 63) / 64,
+                    from_files.words()));
+
   ifstream f(dict.c_str());
   string word;
   unsigned int n_words = 0;
   while(getline(f, word)) {
-    BOOST_CHECK(bf.lookup(word)); // No false negatives!
     n_words++;
   }
+  BOOST_MESSAGE(merged.get_hash_name() << " (map_size = "
+                << merged.get_map_size() << ") merged from "
+                << shards.size() << " shards is estimated to hold "
+                << merged.estimated_size() << " of " << n_words
+                << " words.");
+  BOOST_CHECK(merged.estimated_size() > n_words * 0.8);
+  BOOST_CHECK(merged.estimated_size() < n_words * 1.2);
+}
 
-  BOOST_MESSAGE(bf.get_hash_name() << " (map_size = " << bf.get_map_size()
-                << ") with " << n_words << " entries is "
-                << bf.saturation() << "% full.");
+void test_sharded_intersection()
+{
+  concurrent_bloom_filter<md5_hash<22> > a, b;
+  const vector<string> shards = write_shards(3);
+  a.load_dictionary(shards[0], 1);
+  a.load_dictionary(shards[1], 1);
+  b.load_dictionary(shards[1], 1);
+  b.load_dictionary(shards[2], 1);
+  a.merge_intersection(b);
+
+  ifstream f(shards[1].c_str());
+  string word;
+  while(getline(f, word)) {
+    BOOST_CHECK(a.lookup(word));
+  }
 }
 
-template <size_t len>
-string random_word()
+void test_md5_multi()
 {
-  char word[len + 1] = {0};
+  // All the interesting lengths around the 55/56 and 64 byte boundaries.
+  vector<string> words;
+  words.push_back("");
+  words.push_back("a");
+  words.push_back("bazification");
+  for(unsigned int len = 54; len < 130; len++) {
+    words.push_back(string(len, 'a' + len % 26));
+  }
+  ifstream f(dict.c_str());
+  string word;
+  while(getline(f, word)) {
+    words.push_back(word);
+  }
 
-  for(unsigned int i = 0; i < len; i++) {
-    word[i] = (rand() % 26) + 'a';
+  for(size_t i = 0; i < words.size(); i += md5_multi::lanes) {
+    const unsigned int n = min<size_t>(words.size() - i, md5_multi::lanes);
+    unsigned char digests[md5_multi::lanes][MD5_DIGEST_LENGTH];
+    md5_multi::digest(&words[i], n, digests);
+    for(unsigned int j = 0; j < n; j++) {
+      unsigned char expected[MD5_DIGEST_LENGTH];
+      MD5(reinterpret_cast<const unsigned char *>(words[i + j].data()),
+          words[i + j].size(), expected);
+      BOOST_CHECK(memcmp(digests[j], expected, MD5_DIGEST_LENGTH) == 0);
+    }
   }
-  return string(word);
+}
+
+// Batched hashing must give exactly the same hash_lists, so filters built
+// either way are interchangeable.
+template <class hash_fn>
+void test_batched_hashes()
+{
+  vector<string> words;
+  ifstream f(dict.c_str());
+  string word;
+  while(getline(f, word)) {
+    words.push_back(word);
+  }
+  words.push_back(string(100, 'x'));
+
+  hash_fn hashes;
+  vector<hash_list> batched(words.size());
+  hashes(&words[0], words.size(), &batched[0]);
+  for(size_t i = 0; i < words.size(); i++) {
+    BOOST_CHECK(batched[i] == hashes(words[i]));
+  }
+
+  bloom_filter<hash_fn> serial, batch;
+  serial.load_dictionary(dict);
+  batch.insert(words);
+  vector<bool> found;
+  batch.lookup(words, found);
+  BOOST_CHECK(count(found.begin(), found.end(), false) == 0);
+  BOOST_CHECK_EQUAL(serial.saturation(), batch.saturation());
+
+  vector<string> rwords;
+  for(unsigned int i = 0; i < 1000; i++) {
+    rwords.push_back(random_word<5>());
+  }
+  batch.lookup(rwords, found);
+  for(size_t i = 0; i < rwords.size(); i++) {
+    BOOST_CHECK_EQUAL(serial.lookup(rwords[i]), bool(found[i]));
+  }
+}
+
+void test_open_wrong_policy()
+{
+  const string filename = "kata5.bloom";
+  bloom_filter<md5_hash<16> > bf;
+  bf.insert("foo");
+  bf.save(filename);
+
+  // Same map size, different hash policy.
+  BOOST_CHECK_THROW(mapped_bloom_filter<char_pairs> mbf(filename),
+                    runtime_error);
+  BOOST_CHECK_THROW(mapped_bloom_filter<md5_hash<17> > mbf(filename),
+                    runtime_error);
+  mapped_bloom_filter<md5_hash<16> > mbf(filename);
+  BOOST_CHECK(mbf.lookup("foo"));
 }
 
 template<class hash_fn>
@@ -384,6 +2224,28 @@ test_suite *init_unit_test_suite(int argc, char *argv[])
   t->add(BOOST_TEST_CASE(&test_dictionary<md5_hash<20> >));
   t->add(BOOST_TEST_CASE(&test_dictionary<md5_hash<21> >));
   t->add(BOOST_TEST_CASE(&test_dictionary<md5_hash<22> >));
+  t->add(BOOST_TEST_CASE(&test_concurrent_dictionary<md5_hash<18> >));
+  t->add(BOOST_TEST_CASE(&test_concurrent_dictionary<md5_hash<22> >));
+  t->add(BOOST_TEST_CASE(&test_save_and_open<md5_hash<18> >));
+  t->add(BOOST_TEST_CASE(&test_save_and_open<md5_hash<22> >));
+  t->add(BOOST_TEST_CASE(&test_open_wrong_policy));
+  t->add(BOOST_TEST_CASE(&test_cuckoo_filter<uint8_t>));
+  t->add(BOOST_TEST_CASE(&test_cuckoo_filter<uint16_t>));
+  t->add(BOOST_TEST_CASE(&test_cuckoo_dictionary<uint8_t>));
+  t->add(BOOST_TEST_CASE(&test_cuckoo_dictionary<uint16_t>));
+  t->add(BOOST_TEST_CASE(&test_xor_filter<uint8_t>));
+  t->add(BOOST_TEST_CASE(&test_xor_filter<uint16_t>));
+  t->add(BOOST_TEST_CASE(&test_xor_dictionary<uint8_t>));
+  t->add(BOOST_TEST_CASE(&test_xor_dictionary<uint16_t>));
+  t->add(BOOST_TEST_CASE(&test_scalable_bloom_filter));
+  t->add(BOOST_TEST_CASE(&test_filter_snapshot));
+  t->add(BOOST_TEST_CASE(&test_sharded_union<md5_hash<20> >));
+  t->add(BOOST_TEST_CASE(&test_sharded_union<md5_hash<22> >));
+  t->add(BOOST_TEST_CASE(&test_sharded_intersection));
+  t->add(BOOST_TEST_CASE(&test_md5_multi));
+  t->add(BOOST_TEST_CASE(&test_batched_hashes<md5_hash<16> >));
+  t->add(BOOST_TEST_CASE(&test_batched_hashes<md5_hash<19> >));
+  t->add(BOOST_TEST_CASE(&test_batched_hashes<md5_hash<24> >));
   t->add(BOOST_TEST_CASE(&test_random_words<md5_hash<18> >));
   t->add(BOOST_TEST_CASE(&test_random_words<md5_hash<19> >));
   t->add(BOOST_TEST_CASE(&test_random_words<md5_hash<20> >));
@@ -392,3 +2254,279 @@ test_suite *init_unit_test_suite(int argc, char *argv[])
   t->add(BOOST_TEST_CASE(&test_random_words<md5_hash<24> >));
   return t;
 }
+
+#else // KATA5_BENCHMARK
+
+//////////////////////
+// Benchmark functions
+//////////////////////
+
+// Build with -DKATA5_BENCHMARK (make kata5_bench) for a program which
+// compares the filters and hash policies above on a large seeded key set.
+// Each line of its tab-separated output gives, for one filter: the
+// measured and expected false positive rates, bits per key and the time
+// per insert and per lookup of a key which is (hit) and isn't (miss) in
+// the filter.  The same seed always generates the same keys.
+//
+// Usage: kata5_bench [n_keys [seed [output_file]]]
+
+// xorshift64*, so runs are reproducible whatever rand() does.
+class key_generator
+{
+  uint64_t state;
+
+  uint64_t next()
+  {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dULL;
+  }
+
+ public:
+  key_generator(uint64_t seed)
+    : state(seed ? seed : 1)
+  {
+  }
+
+  // Lower case words of 4 to 12 letters.
+  string operator()()
+  {
+    const unsigned int len = 4 + next() % 9;
+    string word(len, 'a');
+    for(unsigned int i = 0; i < len; i++) {
+      word[i] = 'a' + next() % 26;
+    }
+    return word;
+  }
+
+  // Fisher-Yates, so the order depends on nothing but the seed.
+  template <class RandomAccessIterator>
+  void shuffle(RandomAccessIterator first, RandomAccessIterator last)
+  {
+    for(ptrdiff_t i = last - first; i > 1; i--) {
+      swap(first[i - 1], first[next() % i]);
+    }
+  }
+};
+
+struct bench_result
+{
+  string filter;
+  string hash;
+  double insert_ns;
+  double hit_ns;
+  double miss_ns;
+  double fpr;
+  double expected_fpr;
+  double bits_per_key;
+};
+
+double now_ns()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+template <class filter>
+double time_inserts(filter& f, const vector<string>& keys)
+{
+  const double start = now_ns();
+  for(vector<string>::const_iterator i = keys.begin(); i != keys.end(); i++) {
+    f.insert(*i);
+  }
+  return (now_ns() - start) / keys.size();
+}
+
+template <class filter>
+void time_lookups(const filter& f, const vector<string>& hits,
+                  const vector<string>& misses, bench_result& r)
+{
+  unsigned long found = 0;
+  double start = now_ns();
+  for(vector<string>::const_iterator i = hits.begin(); i != hits.end(); i++) {
+    found += f.lookup(*i);
+  }
+  r.hit_ns = (now_ns() - start) / hits.size();
+  if(found != hits.size()) {
+    cerr << r.filter << ": " << hits.size() - found
+         << " false negatives!" << endl;
+  }
+
+  found = 0;
+  start = now_ns();
+  for(vector<string>::const_iterator i = misses.begin();
+      i != misses.end(); i++) {
+    found += f.lookup(*i);
+  }
+  r.miss_ns = (now_ns() - start) / misses.size();
+  r.fpr = double(found) / misses.size();
+}
+
+// The rate an ideal bloom filter with this hash policy would have: the
+// policy's average number of hashes per key, assumed independent.
+template <class hash_fn>
+double bloom_expected_fpr(const vector<string>& keys, double map_size)
+{
+  hash_fn hashes;
+  double k = 0;
+  for(vector<string>::const_iterator i = keys.begin(); i != keys.end(); i++) {
+    k += hashes(*i).size();
+  }
+  k /= keys.size();
+  return pow(1 - exp(-k * keys.size() / map_size), k);
+}
+
+template <class hash_fn>
+bench_result bench_bloom_filter(const vector<string>& keys,
+                                const vector<string>& misses)
+{
+  // Big maps are too big for the stack.
+  auto_ptr<bloom_filter<hash_fn> > f(new bloom_filter<hash_fn>);
+  bench_result r;
+  r.filter = "bloom_filter";
+  r.hash = f->get_hash_name() + "/"
+    + boost::lexical_cast<string>(f->get_map_size());
+  r.insert_ns = time_inserts(*f, keys);
+  time_lookups(*f, keys, misses, r);
+  r.expected_fpr = bloom_expected_fpr<hash_fn>(keys, f->get_map_size());
+  r.bits_per_key = double(f->get_map_size()) / keys.size();
+  return r;
+}
+
+// The same, hashing keys md5_multi::lanes at a time.
+template <class hash_fn>
+bench_result bench_batched_bloom_filter(const vector<string>& keys,
+                                        const vector<string>& misses)
+{
+  auto_ptr<bloom_filter<hash_fn> > f(new bloom_filter<hash_fn>);
+  bench_result r;
+  r.filter = "bloom_filter(batched)";
+  r.hash = f->get_hash_name() + "/"
+    + boost::lexical_cast<string>(f->get_map_size());
+
+  double start = now_ns();
+  f->insert(keys);
+  r.insert_ns = (now_ns() - start) / keys.size();
+
+  vector<bool> found;
+  start = now_ns();
+  f->lookup(keys, found);
+  r.hit_ns = (now_ns() - start) / keys.size();
+  if(count(found.begin(), found.end(), false) != 0) {
+    cerr << r.filter << ": false negatives!" << endl;
+  }
+  start = now_ns();
+  f->lookup(misses, found);
+  r.miss_ns = (now_ns() - start) / misses.size();
+  r.fpr = double(count(found.begin(), found.end(), true)) / misses.size();
+
+  r.expected_fpr = bloom_expected_fpr<hash_fn>(keys, f->get_map_size());
+  r.bits_per_key = double(f->get_map_size()) / keys.size();
+  return r;
+}
+
+template <typename fingerprint>
+bench_result bench_cuckoo_filter(const vector<string>& keys,
+                                 const vector<string>& misses)
+{
+  cuckoo_filter<fingerprint> f(keys.size());
+  bench_result r;
+  r.filter = f.get_hash_name();
+  r.hash = "md5/" + boost::lexical_cast<string>(sizeof(fingerprint) << 3);
+  r.insert_ns = time_inserts(f, keys);
+  time_lookups(f, keys, misses, r);
+  r.expected_fpr = f.expected_fpr();
+  r.bits_per_key = f.bits_per_key();
+  return r;
+}
+
+template <typename fingerprint>
+bench_result bench_xor_filter(const vector<string>& keys,
+                              const vector<string>& misses)
+{
+  xor_filter<fingerprint> f;
+  bench_result r;
+  r.filter = f.get_hash_name();
+  r.hash = "md5/" + boost::lexical_cast<string>(sizeof(fingerprint) << 3);
+  const double start = now_ns();
+  f.build(keys.begin(), keys.end());
+  r.insert_ns = (now_ns() - start) / keys.size();
+  time_lookups(f, keys, misses, r);
+  r.expected_fpr = f.expected_fpr();
+  r.bits_per_key = f.bits_per_key();
+  return r;
+}
+
+bench_result bench_scalable_bloom_filter(const vector<string>& keys,
+                                         const vector<string>& misses)
+{
+  scalable_bloom_filter f(1024, 0.001);
+  bench_result r;
+  r.filter = f.get_hash_name();
+  r.insert_ns = time_inserts(f, keys);
+  r.hash = "md5/" + boost::lexical_cast<string>(f.n_layers()) + "layers";
+  time_lookups(f, keys, misses, r);
+  r.expected_fpr = f.expected_fpr();
+  r.bits_per_key = f.bits_per_key();
+  return r;
+}
+
+int main(int argc, char *argv[])
+{
+  const size_t n_keys = argc > 1 ? atol(argv[1]) : 1000000;
+  const uint64_t seed = argc > 2 ? strtoull(argv[2], 0, 0) : 1;
+  ofstream out_file;
+  if(argc > 3) {
+    out_file.open(argv[3]);
+  }
+  ostream& out = argc > 3 ? out_file : cout;
+
+  // Distinct keys to insert, then as many keys again which aren't among
+  // them to measure misses and false positives.
+  key_generator gen(seed);
+  vector<string> keys;
+  while(keys.size() < n_keys) {
+    for(size_t i = keys.size(); i < n_keys; i++) {
+      keys.push_back(gen());
+    }
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+  }
+  vector<string> misses;
+  while(misses.size() < n_keys) {
+    string w = gen();
+    if(!binary_search(keys.begin(), keys.end(), w)) {
+      misses.push_back(w);
+    }
+  }
+  // Don't insert in sorted order.
+  gen.shuffle(keys.begin(), keys.end());
+
+  vector<bench_result> results;
+  results.push_back(bench_bloom_filter<split_into_chars>(keys, misses));
+  results.push_back(bench_bloom_filter<char_pairs>(keys, misses));
+  results.push_back(bench_bloom_filter<md5_hash<16> >(keys, misses));
+  results.push_back(bench_bloom_filter<md5_hash<20> >(keys, misses));
+  results.push_back(bench_bloom_filter<md5_hash<24> >(keys, misses));
+  results.push_back(bench_batched_bloom_filter<md5_hash<24> >(keys, misses));
+  results.push_back(bench_cuckoo_filter<uint8_t>(keys, misses));
+  results.push_back(bench_cuckoo_filter<uint16_t>(keys, misses));
+  results.push_back(bench_xor_filter<uint8_t>(keys, misses));
+  results.push_back(bench_xor_filter<uint16_t>(keys, misses));
+  results.push_back(bench_scalable_bloom_filter(keys, misses));
+
+  out << "# n_keys=" << n_keys << " seed=" << seed << endl;
+  out << "filter\thash\tfpr\texpected_fpr\tbits_per_key"
+      << "\tinsert_ns\thit_ns\tmiss_ns" << endl;
+  for(vector<bench_result>::const_iterator r = results.begin();
+      r != results.end(); r++) {
+    out << r->filter << "\t" << r->hash << "\t" << r->fpr << "\t"
+        << r->expected_fpr << "\t" << r->bits_per_key << "\t"
+        << r->insert_ns << "\t" << r->hit_ns << "\t" << r->miss_ns << endl;
+  }
+  return 0;
+}
+
+#endif // KATA5_BENCHMARK
@@ -51,22 +51,74 @@
 // http://www.pragprog.com/pragdave/Practices/Kata/KataSix.rdoc
 
 #include <boost/test/unit_test.hpp>
-#include <boost/compose.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/utility.hpp>
 #include <algorithm>
+#include <numeric>
 #include <functional>
 #include <map>
 #include <set>
+#include <vector>
+#include <queue>
 #include <iterator>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cstring>
+#include <stdexcept>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+
+extern "C" {
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+};
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
 
 using boost::unit_test_framework::test_suite;
-using boost::compose_f_gx;
 using boost::shared_ptr;
+using boost::shared_array;
 
 using namespace std;
 
+// The characters which signatures (and word_reps) have skipped, not
+// being letters, and the bytes skipped for not being valid UTF-8.  These
+// are only counted, once per word, rather than logged, as signatures are
+// worked out on several threads at once and logging every one was
+// slowing big loads down.
+struct skip_counts
+{
+  unsigned long words;      // Words with anything skipped
+  unsigned long characters;
+  unsigned long invalid;
+
+  void add(unsigned long n_characters, unsigned long n_invalid)
+  {
+    if(n_characters == 0 && n_invalid == 0) {
+      return;
+    }
+    __sync_fetch_and_add(&words, 1);
+    __sync_fetch_and_add(&characters, n_characters);
+    __sync_fetch_and_add(&invalid, n_invalid);
+  }
+};
+
+skip_counts skipped;
+
 class word_rep
 {
   unsigned int char_count[26];
@@ -80,14 +132,16 @@ class word_rep
       word(word)
   {
     fill(char_count_begin, char_count_end, 0);
+    unsigned long n_skipped = 0;
     for(string::const_iterator it = word.begin(); it != word.end(); it++) {
-      if(!isalpha(*it)) {
-        BOOST_MESSAGE("Word '" << word << "' contains non-alpha characters.  "
-                      << "Ignoring them...");
+      const unsigned char c = *it;
+      if(c >= 0x80 || !isalpha(c)) {
+        n_skipped++;
         continue;
       }
-      char_count[*it - (islower(*it) ? 'a' : 'A')]++;
+      char_count[c - (islower(c) ? 'a' : 'A')]++;
     }
+    skipped.add(n_skipped, 0);
   }
 
   // Copy-constructor, required to explicitly copy char_count.
@@ -127,122 +181,1973 @@ class word_rep
 
 };
 
+// Unicode support for signatures, without a character database to hand:
+// enough case folding for the Latin, Greek and Cyrillic alphabets, and
+// anything outside the blocks of punctuation, symbols, digits and
+// controls counts as a letter.
+namespace unicode
+{
+  // Decode the UTF-8 sequence starting at word[i], moving i past it.
+  // Returns false, having moved past one byte, if it isn't valid.
+  inline bool decode(const string& word, size_t& i, uint32_t& cp)
+  {
+    const unsigned char c = word[i++];
+    unsigned int n;
+    if(c < 0x80) {
+      cp = c;
+      return true;
+    } else if(c >= 0xc2 && c < 0xe0) {
+      cp = c & 0x1f;
+      n = 1;
+    } else if(c >= 0xe0 && c < 0xf0) {
+      cp = c & 0x0f;
+      n = 2;
+    } else if(c >= 0xf0 && c < 0xf5) {
+      cp = c & 0x07;
+      n = 3;
+    } else {
+      return false;
+    }
+    if(i + n > word.size()) {
+      return false;
+    }
+    for(unsigned int j = 0; j < n; j++) {
+      const unsigned char d = word[i + j];
+      if((d & 0xc0) != 0x80) {
+        return false;
+      }
+      cp = (cp << 6) | (d & 0x3f);
+    }
+    // Overlong encodings, surrogates and beyond the last code point.
+    if((n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000)
+       || (cp >= 0xd800 && cp < 0xe000) || cp > 0x10ffff) {
+      return false;
+    }
+    i += n;
+    return true;
+  }
+
+  inline bool is_letter(uint32_t cp)
+  {
+    if(cp < 0x80) {
+      return (cp | 0x20) >= 'a' && (cp | 0x20) <= 'z';
+    }
+    return !(cp < 0xc0                            // Latin-1 controls, signs
+             || cp == 0xd7 || cp == 0xf7          // Multiplication, division
+             || (cp >= 0x2000 && cp < 0x2c00)     // Punctuation, symbols
+             || (cp >= 0x2e00 && cp < 0x3040)     // CJK punctuation
+             || (cp >= 0xd800 && cp < 0xf900)     // Surrogates, private use
+             || (cp >= 0xfe00 && cp < 0xfe70)     // Variation selectors
+             || (cp >= 0xff00 && cp < 0xff21)     // Fullwidth punctuation
+             || cp >= 0xfff0);
+  }
+
+  inline uint32_t fold(uint32_t cp)
+  {
+    if(cp < 0x80) {
+      return cp | 0x20;
+    }
+    if((cp >= 0xc0 && cp <= 0xde && cp != 0xd7)  // Latin-1
+       || (cp >= 0x391 && cp <= 0x3ab && cp != 0x3a2)  // Greek
+       || (cp >= 0x410 && cp <= 0x42f)) {        // Cyrillic
+      return cp + 0x20;
+    }
+    if(cp >= 0x400 && cp <= 0x40f) {
+      return cp + 0x50;
+    }
+    // Latin Extended-A, and the rest of Cyrillic, pair each capital with
+    // the small letter after it, except in two stretches of Latin where
+    // the pairs start on the odd code points.
+    if((cp >= 0x100 && cp < 0x138) || (cp >= 0x14a && cp < 0x178)
+       || (cp >= 0x460 && cp < 0x482) || (cp >= 0x48a && cp < 0x4c0)) {
+      return cp | 1;
+    }
+    if((cp >= 0x139 && cp < 0x149) || (cp >= 0x179 && cp < 0x17f)) {
+      return (cp & 1) ? cp + 1 : cp;
+    }
+    switch(cp) {
+    case 0x178: return 0xff;   // Y with diaeresis
+    case 0x386: return 0x3ac;  // Greek capitals with tonos
+    case 0x388: return 0x3ad;
+    case 0x389: return 0x3ae;
+    case 0x38a: return 0x3af;
+    case 0x38c: return 0x3cc;
+    case 0x38e: return 0x3cd;
+    case 0x38f: return 0x3ce;
+    case 0x3c2: return 0x3c3;  // Final sigma
+    }
+    return cp;
+  }
+}
+
+// A compact equivalent of word_rep, for use as a key: the count of each
+// letter packed into four bits of a 128-bit integer, 'a' most significant,
+// so comparing two signatures is comparing two pairs of integers and
+// gives the same order as word_rep.  A word with more than 15 of any
+// letter overflows, and keeps all its counts on the heap instead.
+//
+// Words are UTF-8, and a word with a letter outside a to z overflows too,
+// keeping a histogram of its case folded code points on the heap.  Those
+// come after all the words made only of a to z.  The common case of a
+// word which is all ASCII is spotted eight bytes at a time and counted
+// through a table, without decoding anything.
+class word_signature
+{
+  static const unsigned int n_letters = 26;
+  static const unsigned int hi_letters = 16;  // 'a' to 'p' in hi
+  static const uint64_t overflow_flag = 1;    // Low bit of lo
+  static const uint64_t unicode_flag = 2;     // Next bit up
+
+  uint64_t hi, lo;
+
+  // When overflowed, either the n_letters counts or, for a Unicode word,
+  // the number of distinct letters followed by (code point, count) pairs
+  // in code point order.
+  shared_array<unsigned int> wide;
+
+  // Letter index of each byte, or n_letters if it isn't an ASCII letter.
+  struct ascii_table
+  {
+    unsigned char index[256];
+
+    ascii_table()
+    {
+      for(unsigned int c = 0; c < 256; c++) {
+        index[c] = c >= 'a' && c <= 'z' ? c - 'a'
+          : c >= 'A' && c <= 'Z' ? c - 'A' : n_letters;
+      }
+    }
+  };
+  static const ascii_table ascii;
+
+  static bool is_ascii(const string& word)
+  {
+    const char *p = word.data(), *end = p + word.size();
+    uint64_t high_bits = 0;
+    for(; end - p >= 8; p += 8) {
+      uint64_t chunk;
+      memcpy(&chunk, p, sizeof chunk);
+      high_bits |= chunk;
+    }
+    for(; p != end; p++) {
+      high_bits |= static_cast<unsigned char>(*p);
+    }
+    return (high_bits & 0x8080808080808080ULL) == 0;
+  }
+
+  // The length of wide, for comparing.
+  unsigned int wide_size() const
+  {
+    return unicode() ? 1 + 2 * wide[0] : n_letters;
+  }
+
+  void counts(unsigned int *c) const
+  {
+    if(wide) {
+      copy(wide.get(), wide.get() + n_letters, c);
+      return;
+    }
+    for(unsigned int i = 0; i < n_letters; i++) {
+      c[i] = (i < hi_letters ? hi >> ((hi_letters - 1 - i) << 2)
+              : lo >> ((hi_letters - 1 - (i - hi_letters)) << 2)) & 0xf;
+    }
+  }
+
+  // Count the letters of a word which isn't all ASCII into c, returning
+  // false (and setting up the histogram instead) if any are outside a to
+  // z.
+  bool count_unicode(const string& word, unsigned int *c,
+                     unsigned long& n_skipped, unsigned long& n_invalid)
+  {
+    vector<uint32_t> others;
+    for(size_t i = 0; i < word.size(); ) {
+      uint32_t cp;
+      if(!unicode::decode(word, i, cp)) {
+        n_invalid++;
+      } else if(!unicode::is_letter(cp)) {
+        n_skipped++;
+      } else if(cp < 0x80) {
+        c[ascii.index[cp]]++;
+      } else {
+        others.push_back(unicode::fold(cp));
+      }
+    }
+    if(others.empty()) {
+      return true;
+    }
+
+    for(unsigned int l = 0; l < n_letters; l++) {
+      others.insert(others.end(), c[l], 'a' + l);
+    }
+    sort(others.begin(), others.end());
+    vector<unsigned int> h(1, 0);
+    for(size_t i = 0; i < others.size(); ) {
+      size_t j = i;
+      while(j < others.size() && others[j] == others[i]) {
+        j++;
+      }
+      h.push_back(others[i]);
+      h.push_back(j - i);
+      h[0]++;
+      i = j;
+    }
+    wide = shared_array<unsigned int>(new unsigned int[h.size()]);
+    copy(h.begin(), h.end(), wide.get());
+    lo = overflow_flag | unicode_flag;
+    return false;
+  }
+
+ public:
+  word_signature(const string& word)
+    : hi(0), lo(0)
+  {
+    unsigned int c[n_letters + 1] = {0}; // Plus one for everything else
+    unsigned long n_skipped = 0, n_invalid = 0;
+    if(is_ascii(word)) {
+      for(string::const_iterator it = word.begin(); it != word.end(); it++) {
+        c[ascii.index[static_cast<unsigned char>(*it)]]++;
+      }
+      n_skipped = c[n_letters];
+    } else if(!count_unicode(word, c, n_skipped, n_invalid)) {
+      skipped.add(n_skipped, n_invalid);
+      return;
+    }
+    skipped.add(n_skipped, n_invalid);
+
+    bool overflow = false;
+    for(unsigned int i = 0; i < n_letters; i++) {
+      overflow |= c[i] > 0xf;
+    }
+    if(overflow) {
+      lo = overflow_flag;
+      wide = shared_array<unsigned int>(new unsigned int[n_letters]);
+      copy(c, c + n_letters, wide.get());
+      return;
+    }
+    for(unsigned int i = 0; i < hi_letters; i++) {
+      hi = (hi << 4) | c[i];
+    }
+    for(unsigned int i = hi_letters; i < n_letters; i++) {
+      lo = (lo << 4) | c[i];
+    }
+    lo <<= (2 * hi_letters - n_letters) << 2;
+  }
+
+  // A signature rebuilt from its packed counts, which mustn't have
+  // overflowed.
+  word_signature(uint64_t hi, uint64_t lo)
+    : hi(hi), lo(lo)
+  {
+  }
+
+  // Whether the counts didn't fit in the packed form, because there were
+  // too many of a letter or because of a letter outside a to z.
+  bool overflowed() const
+  {
+    return lo & overflow_flag;
+  }
+
+  // Whether the word has a letter outside a to z.
+  bool unicode() const
+  {
+    return lo & unicode_flag;
+  }
+
+  // The number of letters in the word.
+  unsigned int length() const
+  {
+    if(unicode()) {
+      unsigned int n = 0;
+      for(unsigned int i = 0; i < wide[0]; i++) {
+        n += wide[2 + 2 * i];
+      }
+      return n;
+    }
+    unsigned int c[n_letters];
+    counts(c);
+    return accumulate(c, c + n_letters, 0U);
+  }
+
+  // The packed counts, for sorting on directly.  Only meaningful if the
+  // signature hasn't overflowed.
+  uint64_t high() const
+  {
+    return hi;
+  }
+  uint64_t low() const
+  {
+    return lo;
+  }
+
+  bool operator==(const word_signature& rhs) const
+  {
+    if(hi != rhs.hi || lo != rhs.lo) {
+      return false;
+    }
+    if(!overflowed()) {
+      return true;
+    }
+    // Unicode histograms differ in length with the number of letters.
+    return wide_size() == rhs.wide_size()
+      && equal(wide.get(), wide.get() + wide_size(), rhs.wide.get());
+  }
+
+  bool operator!=(const word_signature& rhs) const
+  {
+    return !operator==(rhs);
+  }
+
+  bool operator<(const word_signature& rhs) const
+  {
+    if(!overflowed() && !rhs.overflowed()) {
+      return hi < rhs.hi || (hi == rhs.hi && lo < rhs.lo);
+    }
+    if(unicode() || rhs.unicode()) {
+      if(unicode() != rhs.unicode()) {
+        return rhs.unicode();
+      }
+      return lexicographical_compare(wide.get() + 1,
+                                     wide.get() + wide_size(),
+                                     rhs.wide.get() + 1,
+                                     rhs.wide.get() + rhs.wide_size());
+    }
+    unsigned int l[n_letters], r[n_letters];
+    counts(l);
+    rhs.counts(r);
+    return lexicographical_compare(l, l + n_letters, r, r + n_letters);
+  }
+
+  size_t hash() const
+  {
+    uint64_t h = hi * 0x9e3779b97f4a7c15ULL ^ lo;
+    if(overflowed()) {
+      for(unsigned int i = 0; i < wide_size(); i++) {
+        h = h * 31 + wide[i];
+      }
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
+};
+
+const word_signature::ascii_table word_signature::ascii;
+
 class anagrams
 {
  public:
   typedef const string& const_reference;
-  typedef set<string> word_list;
+  class word_list;
   friend ostream& operator<<(ostream& s, const anagrams::word_list& l);
 
  private:
-  typedef map<word_rep, word_list> anagram_list;
+  // Every distinct word is interned, NUL-terminated, in one arena, and
+  // groups refer to words by their offset in it.  Once all the words are
+  // in, each group's words are laid out as a sorted span of one flat
+  // array of offsets; that is redone when the groups are next looked at
+  // after an insert.
+  //
+  // Groups are found through an open-addressing hash table keyed on
+  // their signatures, which is much cheaper to insert into than a map of
+  // word_reps.  Iteration is in signature order (as it was when this was
+  // a map), so the groups are sorted at the same time.
+  //
+  // Only groups with more than one word are of interest, so those are
+  // indexed separately as they reach their second word, along with the
+  // largest group and the one with the longest words.  Only they are
+  // laid out and sorted, and iteration never sees a lone word.
+  vector<char> arena;
+  vector<uint32_t> word_table; // Arena offset + 1, or 0 if the slot is empty
+
+  struct entry
+  {
+    uint32_t group;
+    uint32_t word;
+  };
+  vector<entry> entries; // One per distinct word, in order of arrival
+
+  mutable vector<uint32_t> flat;
+
+  // Linear probing: return the slot holding w, or the empty slot where it
+  // belongs.
+  size_t probe_word(const string& w, size_t h) const
+  {
+    const size_t mask = word_table.size() - 1;
+    size_t i = h & mask;
+    while(word_table[i] != 0) {
+      const char *p = &arena[word_table[i] - 1];
+      // Stops at the end of a shorter word, rather than reading past it.
+      if(strncmp(p, w.data(), w.size()) == 0 && p[w.size()] == '\0') {
+        break;
+      }
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  static size_t hash_word(const char *p, size_t len)
+  {
+    size_t h = 2166136261U; // FNV-1a
+    for(size_t i = 0; i < len; i++) {
+      h = (h ^ static_cast<unsigned char>(p[i])) * 16777619U;
+    }
+    return h;
+  }
+
+  // Returns true, and sets offset, if the word wasn't already interned.
+  bool intern(const string& w, uint32_t& offset)
+  {
+    if((entries.size() + 1) * 10 > word_table.size() * 7) {
+      vector<uint32_t> old(word_table.empty() ? 16 : word_table.size() * 2,
+                           0);
+      word_table.swap(old);
+      const size_t mask = word_table.size() - 1;
+      for(vector<entry>::const_iterator e = entries.begin();
+          e != entries.end(); e++) {
+        const char *p = &arena[e->word];
+        size_t i = hash_word(p, strlen(p)) & mask;
+        while(word_table[i] != 0) {
+          i = (i + 1) & mask;
+        }
+        word_table[i] = e->word + 1;
+      }
+    }
+
+    const size_t i = probe_word(w, hash_word(w.data(), w.size()));
+    if(word_table[i] != 0) {
+      return false;
+    }
+    offset = arena.size();
+    arena.insert(arena.end(), w.begin(), w.end());
+    arena.push_back('\0');
+    word_table[i] = offset + 1;
+    return true;
+  }
+
+  struct by_spelling
+  {
+    const vector<char>& arena;
 
-  anagram_list al;
+    by_spelling(const vector<char>& arena)
+      : arena(arena)
+    {
+    }
+    bool operator()(uint32_t a, uint32_t b) const
+    {
+      return strcmp(&arena[a], &arena[b]) < 0;
+    }
+  };
 
  public:
-  class iterator : public std::iterator<std::bidirectional_iterator_tag,
-                                        word_list, ptrdiff_t>
+  // A view of one group's words, which behaves like the set<string> it
+  // replaces: iterating over it gives the words in order.
+  class word_list
   {
-    const anagrams* al;
-    anagram_list::const_iterator it;
+    const anagrams *al;
+    uint32_t first, last;
 
   public:
-    iterator(const anagrams& a, const anagram_list::const_iterator& i)
-      : al(&a), it(i)
+    typedef string value_type;
+
+    class const_iterator
+      : public std::iterator<std::bidirectional_iterator_tag, string,
+                             ptrdiff_t, const string*, string>
     {
-    }
+      const anagrams *al;
+      const uint32_t *p;
 
-    bool operator==(const iterator& x) const
+      struct arrow
+      {
+        string w;
+        const string* operator->() const
+        {
+          return &w;
+        }
+      };
+
+    public:
+      const_iterator(const anagrams *al, const uint32_t *p)
+        : al(al), p(p)
+      {
+      }
+
+      bool operator==(const const_iterator& x) const
+      {
+        return p == x.p;
+      }
+      bool operator!=(const const_iterator& x) const
+      {
+        return p != x.p;
+      }
+      string operator*() const
+      {
+        return string(&al->arena[*p]);
+      }
+      arrow operator->() const
+      {
+        arrow a = { **this };
+        return a;
+      }
+      const_iterator& operator++()
+      {
+        ++p;
+        return *this;
+      }
+      const_iterator operator++(int)
+      {
+        const_iterator tmp = *this;
+        ++p;
+        return tmp;
+      }
+      const_iterator& operator--()
+      {
+        --p;
+        return *this;
+      }
+      const_iterator operator--(int)
+      {
+        const_iterator tmp = *this;
+        --p;
+        return tmp;
+      }
+      ptrdiff_t operator-(const const_iterator& x) const
+      {
+        return p - x.p;
+      }
+    };
+
+    word_list(const anagrams *al = 0, uint32_t first = 0, uint32_t last = 0)
+      : al(al), first(first), last(last)
     {
-      return it == x.it;
     }
-    bool operator!=(const iterator& x) const
+
+    const_iterator begin() const
     {
-      return !(*this == x);
+      return const_iterator(al, &al->flat[0] + first);
     }
-    const word_list& operator*() const
+    const_iterator end() const
     {
-      return it->second;
+      return const_iterator(al, &al->flat[0] + last);
     }
-    const word_list* operator->() const
+    size_t size() const
     {
-      return &it->second;
+      return last - first;
     }
+  };
 
-    iterator& operator++()
+ private:
+  struct group
+  {
+    word_signature sig;
+    uint32_t n_words;
+    word_list words;
+
+    group()
+      : sig(string()), n_words(0)
     {
-      do {
-        ++it;
-      } while(it->second.size() < 2 && *this != al->end());
-      return *this;
     }
-    iterator operator++(int)
+
+    group(const word_signature& sig)
+      : sig(sig), n_words(0)
     {
-      iterator tmp = *this;
-      ++*this;
-      return tmp;
     }
-    iterator& operator--()
+  };
+  typedef vector<group> group_list;
+
+  // Mutable as finishing the layout off doesn't change the contents.
+  mutable group_list groups;
+  vector<uint32_t> table; // Group index + 1, or 0 if the slot is empty
+  vector<uint32_t> multi; // Groups with more than one word
+  uint32_t largest;       // Group index + 1, or 0 if there isn't one
+  uint32_t longest;       // Likewise
+  mutable vector<uint32_t> order;
+  mutable bool order_valid;
+
+  struct by_signature
+  {
+    const group_list& groups;
+
+    by_signature(const group_list& groups)
+      : groups(groups)
     {
-      do {
-        --it;
-      } while(it->second.size() < 2 && *this != al->begin());
-      return *this;
     }
-    iterator operator--(int)
+    bool operator()(uint32_t a, uint32_t b) const
     {
-      iterator tmp = *this;
-      --*this;
-      return tmp;
+      return groups[a].sig < groups[b].sig;
     }
   };
 
-  void insert(const string& w)
+  // Linear probing: return the slot holding sig, or the empty slot where
+  // it belongs.
+  size_t probe(const word_signature& sig) const
   {
-    al[word_rep(w)].insert(w);
+    const size_t mask = table.size() - 1;
+    size_t i = sig.hash() & mask;
+    while(table[i] != 0 && groups[table[i] - 1].sig != sig) {
+      i = (i + 1) & mask;
+    }
+    return i;
   }
-  void push_back(const string& w)
+
+  void grow()
+  {
+    vector<uint32_t> old(table.empty() ? 16 : table.size() * 2, 0);
+    table.swap(old);
+    for(uint32_t g = 0; g < groups.size(); g++) {
+      table[probe(groups[g].sig)] = g + 1;
+    }
+  }
+
+  // Whether group g, scoring n, should replace best (a group index + 1),
+  // scoring best_n.  Ties go to the group which comes first in iteration
+  // order, as they would to a search through it.
+  bool beats(uint32_t g, unsigned int n, uint32_t best,
+             unsigned int best_n) const
+  {
+    return best == 0 || n > best_n
+      || (n == best_n && g + 1 != best && groups[g].sig < groups[best - 1].sig);
+  }
+
+  // Group g has just got its second word.
+  void note_multi(uint32_t g)
+  {
+    multi.push_back(g);
+    if(beats(g, groups[g].sig.length(), longest,
+             longest == 0 ? 0 : groups[longest - 1].sig.length())) {
+      longest = g + 1;
+    }
+  }
+
+  // Group g, which has more than one word, has grown.
+  void note_size(uint32_t g)
+  {
+    if(beats(g, groups[g].n_words, largest,
+             largest == 0 ? 0 : groups[largest - 1].n_words)) {
+      largest = g + 1;
+    }
+  }
+
+  uint32_t find_group(const word_signature& sig)
+  {
+    // Keep the table no more than 70% full.
+    if((groups.size() + 1) * 10 > table.size() * 7) {
+      grow();
+    }
+    const size_t i = probe(sig);
+    if(table[i] == 0) {
+      groups.push_back(group(sig));
+      table[i] = groups.size();
+    }
+    return table[i] - 1;
+  }
+
+  // Smallest power of two table which keeps n entries below 70% full.
+  static size_t table_size(size_t n)
+  {
+    size_t size = 16;
+    while((n + 1) * 10 > size * 7) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  // Store value in the first free slot from h onwards.  Used when several
+  // threads are filling one table with distinct keys, so it never needs to
+  // compare keys, just claim a slot.
+  static void claim_slot(vector<uint32_t>& t, size_t h, uint32_t value)
+  {
+    const size_t mask = t.size() - 1;
+    for(size_t i = h & mask; ; i = (i + 1) & mask) {
+      if(__sync_bool_compare_and_swap(&t[i], 0, value)) {
+        return;
+      }
+    }
+  }
+
+  // Parallel build, phase one: work out the signatures of the words in
+  // [begin, end), kept for phase two, and which partition each belongs
+  // in.  Equal signatures (and so equal words) always end up in the same
+  // partition.
+  static void partition_words(const vector<string>& words, size_t begin,
+                              size_t end, vector<word_signature>& sigs,
+                              vector<vector<uint32_t> >& parts)
+  {
+    for(size_t i = begin; i < end; i++) {
+      sigs[i] = word_signature(words[i]);
+      parts[sigs[i].hash() % parts.size()].push_back(i);
+    }
+  }
+
+  // Phase two: build one partition from every thread's share of it, in
+  // thread order so words arrive in the same order as the input.
+  static void build_partition(const vector<string>& words,
+                              const vector<word_signature>& sigs,
+                              const vector<vector<vector<uint32_t> > >& parts,
+                              size_t p, anagrams *part)
+  {
+    for(size_t t = 0; t < parts.size(); t++) {
+      for(vector<uint32_t>::const_iterator i = parts[t][p].begin();
+          i != parts[t][p].end(); i++) {
+        part->insert(words[*i], sigs[*i]);
+      }
+    }
+  }
+
+  // Phase three: copy a partition into its own range of this container's
+  // arrays.  The partitions hold disjoint words and groups, so the only
+  // shared state is the hash tables, which are filled lock-free.
+  void absorb(const anagrams *part, uint32_t arena_base, uint32_t group_base,
+              uint32_t entry_base)
+  {
+    copy(part->arena.begin(), part->arena.end(), arena.begin() + arena_base);
+    for(uint32_t g = 0; g < part->groups.size(); g++) {
+      groups[group_base + g].sig = part->groups[g].sig;
+      groups[group_base + g].n_words = part->groups[g].n_words;
+      claim_slot(table, part->groups[g].sig.hash(), group_base + g + 1);
+    }
+    for(uint32_t i = 0; i < part->entries.size(); i++) {
+      entry e = { part->entries[i].group + group_base,
+                  part->entries[i].word + arena_base };
+      entries[entry_base + i] = e;
+      const char *w = &arena[e.word];
+      claim_slot(word_table, hash_word(w, strlen(w)), e.word + 1);
+    }
+  }
+
+  // The word_lists refer back into this object, so it can't be copied.
+  anagrams(const anagrams&);
+  anagrams& operator=(const anagrams&);
+
+  // Lay the words of the groups with more than one word out group by
+  // group (a counting sort on the group), sort each group's words, and
+  // sort the groups.
+  const vector<uint32_t>& sorted() const
+  {
+    if(order_valid) {
+      return order;
+    }
+
+    vector<uint32_t> next(groups.size(), UINT32_MAX);
+    uint32_t offset = 0;
+    for(vector<uint32_t>::const_iterator g = multi.begin(); g != multi.end();
+        g++) {
+      next[*g] = offset;
+      groups[*g].words = word_list(this, offset, offset + groups[*g].n_words);
+      offset += groups[*g].n_words;
+    }
+    flat.resize(offset);
+    for(vector<entry>::const_iterator e = entries.begin();
+        e != entries.end(); e++) {
+      if(next[e->group] != UINT32_MAX) {
+        flat[next[e->group]++] = e->word;
+      }
+    }
+    for(vector<uint32_t>::const_iterator g = multi.begin(); g != multi.end();
+        g++) {
+      sort(flat.begin() + (next[*g] - groups[*g].n_words),
+           flat.begin() + next[*g], by_spelling(arena));
+    }
+
+    order = multi;
+    sort(order.begin(), order.end(), by_signature(groups));
+    order_valid = true;
+    return order;
+  }
+
+ public:
+  class iterator : public std::iterator<std::bidirectional_iterator_tag,
+                                        word_list, ptrdiff_t>
+  {
+    const anagrams* al;
+    size_t pos;
+
+    const word_list& words() const
+    {
+      return al->groups[al->order[pos]].words;
+    }
+
+  public:
+    iterator(const anagrams& a, size_t pos)
+      : al(&a), pos(pos)
+    {
+    }
+
+    bool operator==(const iterator& x) const
+    {
+      return pos == x.pos;
+    }
+    bool operator!=(const iterator& x) const
+    {
+      return !(*this == x);
+    }
+    const word_list& operator*() const
+    {
+      return words();
+    }
+    const word_list* operator->() const
+    {
+      return &words();
+    }
+
+    iterator& operator++()
+    {
+      ++pos;
+      return *this;
+    }
+    iterator operator++(int)
+    {
+      iterator tmp = *this;
+      ++*this;
+      return tmp;
+    }
+    iterator& operator--()
+    {
+      --pos;
+      return *this;
+    }
+    iterator operator--(int)
+    {
+      iterator tmp = *this;
+      --*this;
+      return tmp;
+    }
+  };
+
+  anagrams()
+    : largest(0), longest(0), order_valid(true)
+  {
+  }
+
+  void insert(const string& w)
+  {
+    insert(w, word_signature(w));
+  }
+  // For a word whose signature has already been worked out.
+  void insert(const string& w, const word_signature& sig)
+  {
+    uint32_t offset;
+    if(!intern(w, offset)) {
+      return;
+    }
+    const uint32_t g = find_group(sig);
+    groups[g].n_words++;
+    entry e = { g, offset };
+    entries.push_back(e);
+    if(groups[g].n_words == 2) {
+      note_multi(g);
+    }
+    if(groups[g].n_words >= 2) {
+      note_size(g);
+    }
+    order_valid = false;
+  }
+  void push_back(const string& w)
+  {
+    insert(w);
+  }
+
+  // Insert all the words using n_threads threads, giving exactly the same
+  // result as inserting them one by one.  The words are split between the
+  // threads, which partition them by signature; each partition is then
+  // built independently and they're all copied in side by side.  Only
+  // an empty container is built in parallel.
+  void insert(const vector<string>& words,
+              unsigned int n_threads = boost::thread::hardware_concurrency())
+  {
+    if(!entries.empty() || n_threads < 2) {
+      copy(words.begin(), words.end(), back_inserter(*this));
+      return;
+    }
+
+    vector<word_signature> sigs(words.size(), word_signature(string()));
+    vector<vector<vector<uint32_t> > >
+      parts(n_threads, vector<vector<uint32_t> >(n_threads));
+    boost::thread_group partitioners;
+    for(unsigned int t = 0; t < n_threads; t++) {
+      partitioners.create_thread(boost::bind(&anagrams::partition_words,
+                                             boost::cref(words),
+                                             words.size() * t / n_threads,
+                                             words.size() * (t + 1) / n_threads,
+                                             boost::ref(sigs),
+                                             boost::ref(parts[t])));
+    }
+    partitioners.join_all();
+
+    vector<shared_ptr<anagrams> > partitions;
+    boost::thread_group builders;
+    for(unsigned int p = 0; p < n_threads; p++) {
+      partitions.push_back(shared_ptr<anagrams>(new anagrams));
+      builders.create_thread(boost::bind(&anagrams::build_partition,
+                                         boost::cref(words), boost::cref(sigs),
+                                         boost::cref(parts), p,
+                                         partitions.back().get()));
+    }
+    builders.join_all();
+
+    size_t n_arena = 0, n_groups = 0, n_entries = 0;
+    vector<uint32_t> arena_base, group_base, entry_base;
+    for(unsigned int p = 0; p < n_threads; p++) {
+      arena_base.push_back(n_arena);
+      group_base.push_back(n_groups);
+      entry_base.push_back(n_entries);
+      n_arena += partitions[p]->arena.size();
+      n_groups += partitions[p]->groups.size();
+      n_entries += partitions[p]->entries.size();
+    }
+    arena.resize(n_arena);
+    groups.resize(n_groups);
+    entries.resize(n_entries);
+    table.assign(table_size(n_groups), 0);
+    word_table.assign(table_size(n_entries), 0);
+
+    boost::thread_group absorbers;
+    for(unsigned int p = 0; p < n_threads; p++) {
+      absorbers.create_thread(boost::bind(&anagrams::absorb, this,
+                                          partitions[p].get(), arena_base[p],
+                                          group_base[p], entry_base[p]));
+    }
+    absorbers.join_all();
+
+    for(unsigned int p = 0; p < n_threads; p++) {
+      for(vector<uint32_t>::const_iterator g = partitions[p]->multi.begin();
+          g != partitions[p]->multi.end(); g++) {
+        note_multi(group_base[p] + *g);
+        note_size(group_base[p] + *g);
+      }
+    }
+    order_valid = false;
+  }
+
+  iterator begin() const
+  {
+    sorted();
+    return iterator(*this, 0);
+  }
+
+  iterator end() const
+  {
+    return iterator(*this, multi.size());
+  }
+
+  // The number of groups of anagrams, not counting lone words.
+  size_t size() const
+  {
+    return multi.size();
+  }
+
+  // The group with the most words, and the one with the longest words.
+  // Only meaningful if size() isn't 0.
+  const word_list& largest_group() const
+  {
+    sorted();
+    return groups[largest - 1].words;
+  }
+  const word_list& longest_anagram() const
+  {
+    sorted();
+    return groups[longest - 1].words;
+  }
+
+  // The group of anagrams w belongs in, or 0 if there isn't one with
+  // more than one word.
+  const word_list* find(const string& w) const
+  {
+    if(table.empty()) {
+      return 0;
+    }
+    const uint32_t g = table[probe(word_signature(w))];
+    if(g == 0 || groups[g - 1].n_words < 2) {
+      return 0;
+    }
+    sorted();
+    return &groups[g - 1].words;
+  }
+
+  friend ostream& operator<<(ostream& s, const anagrams& a)
+  {
+    // FIXME: Why doesn't the copy() version work?
+    // copy(a.begin(), a.end(), ostream_iterator<word_list>(s, "\n"));
+    for(iterator it = a.begin(); it != a.end(); it++) {
+      s << *it << "..." << endl;
+    }
+    return s;
+  }
+};
+
+ostream& operator<<(ostream& s, const anagrams::word_list& l)
+{
+  anagrams::word_list::const_iterator j = l.begin();
+  s << *j;
+  while(++j != l.end()) {
+    s << " " << *j;
+  }
+  return s;
+}
+
+// One-shot grouping of a whole word list, for when the groups are only
+// wanted once.  Rather than inserting words one at a time, the
+// (signature, word) pairs are radix sorted on the packed signature so each
+// group of anagrams ends up as a contiguous run.  The few words whose
+// signatures overflow are sorted separately and merged in.  The groups
+// come out in the same order, and write out the same, as anagrams.
+//
+// The word list must outlive this object.
+class batch_anagrams
+{
+  struct keyed
+  {
+    uint64_t hi, lo;
+    uint32_t id;
+  };
+
+  const vector<string>& words;
+  vector<uint32_t> ids;  // Grouped words, each group in spelling order
+  vector<uint32_t> runs; // Where each group starts in ids, then the end
+
+  // LSD radix sort, 16 bits at a time, on the significant bits of the
+  // signature: all of hi and the top 40 bits of lo.  A pass where every
+  // key has the same digit is skipped.
+  static void radix_sort(vector<keyed>& v)
+  {
+    static const unsigned int lo_shifts[] = { 24, 40, 56 };
+    vector<keyed> tmp(v.size());
+    vector<size_t> count(1 << 16);
+    for(unsigned int pass = 0; pass < 7; pass++) {
+      const bool high = pass >= 3;
+      const unsigned int shift = high ? (pass - 3) * 16 : lo_shifts[pass];
+
+      fill(count.begin(), count.end(), 0);
+      for(vector<keyed>::const_iterator k = v.begin(); k != v.end(); k++) {
+        count[((high ? k->hi : k->lo) >> shift) & 0xffff]++;
+      }
+      if(v.empty() || count[((high ? v[0].hi : v[0].lo) >> shift) & 0xffff]
+         == v.size()) {
+        continue;
+      }
+      size_t total = 0;
+      for(vector<size_t>::iterator c = count.begin(); c != count.end(); c++) {
+        const size_t n = *c;
+        *c = total;
+        total += n;
+      }
+      for(vector<keyed>::const_iterator k = v.begin(); k != v.end(); k++) {
+        tmp[count[((high ? k->hi : k->lo) >> shift) & 0xffff]++] = *k;
+      }
+      v.swap(tmp);
+    }
+  }
+
+  struct by_spelling
+  {
+    const vector<string>& words;
+
+    by_spelling(const vector<string>& words)
+      : words(words)
+    {
+    }
+    bool operator()(uint32_t a, uint32_t b) const
+    {
+      return words[a] < words[b];
+    }
+  };
+
+  struct same_spelling
+  {
+    const vector<string>& words;
+
+    same_spelling(const vector<string>& words)
+      : words(words)
+    {
+    }
+    bool operator()(uint32_t a, uint32_t b) const
+    {
+      return words[a] == words[b];
+    }
+  };
+
+  struct by_signature
+  {
+    const vector<string>& words;
+
+    by_signature(const vector<string>& words)
+      : words(words)
+    {
+    }
+    bool operator()(uint32_t a, uint32_t b) const
+    {
+      const word_signature sa(words[a]), sb(words[b]);
+      return sa < sb || (sa == sb && words[a] < words[b]);
+    }
+  };
+
+  // Sort a run of anagrams by spelling, drop repeats and append it.
+  void add_run(vector<uint32_t>& run)
+  {
+    sort(run.begin(), run.end(), by_spelling(words));
+    run.erase(unique(run.begin(), run.end(), same_spelling(words)),
+              run.end());
+    runs.push_back(ids.size());
+    ids.insert(ids.end(), run.begin(), run.end());
+  }
+
+ public:
+  batch_anagrams(const vector<string>& words)
+    : words(words)
+  {
+    vector<keyed> keys;
+    vector<uint32_t> overflowed;
+    keys.reserve(words.size());
+    for(uint32_t i = 0; i < words.size(); i++) {
+      const word_signature sig(words[i]);
+      if(sig.overflowed()) {
+        overflowed.push_back(i);
+      } else {
+        keyed k = { sig.high(), sig.low(), i };
+        keys.push_back(k);
+      }
+    }
+    radix_sort(keys);
+    sort(overflowed.begin(), overflowed.end(), by_signature(words));
+
+    // Merge the two sorted sequences a run at a time.
+    ids.reserve(words.size());
+    vector<uint32_t> run;
+    size_t k = 0, o = 0;
+    while(k < keys.size() || o < overflowed.size()) {
+      run.clear();
+      if(o == overflowed.size()
+         || (k < keys.size()
+             && word_signature(words[keys[k].id])
+                < word_signature(words[overflowed[o]]))) {
+        const size_t start = k;
+        while(k < keys.size() && keys[k].hi == keys[start].hi
+              && keys[k].lo == keys[start].lo) {
+          run.push_back(keys[k++].id);
+        }
+      } else {
+        const word_signature sig(words[overflowed[o]]);
+        while(o < overflowed.size()
+              && word_signature(words[overflowed[o]]) == sig) {
+          run.push_back(overflowed[o++]);
+        }
+      }
+      add_run(run);
+    }
+    runs.push_back(ids.size());
+  }
+
+  // The number of groups with more than one word, like anagrams::size().
+  size_t size() const
+  {
+    size_t n = 0;
+    for(size_t g = 0; g + 1 < runs.size(); g++) {
+      n += runs[g + 1] - runs[g] > 1;
+    }
+    return n;
+  }
+
+  friend ostream& operator<<(ostream& s, const batch_anagrams& a)
+  {
+    for(size_t g = 0; g + 1 < a.runs.size(); g++) {
+      if(a.runs[g + 1] - a.runs[g] < 2) {
+        continue;
+      }
+      s << a.words[a.ids[a.runs[g]]];
+      for(uint32_t i = a.runs[g] + 1; i < a.runs[g + 1]; i++) {
+        s << " " << a.words[a.ids[i]];
+      }
+      s << "..." << endl;
+    }
+    return s;
+  }
+};
+
+// Grouping for word lists too big to hold in memory.  Words are buffered
+// with their signatures until the buffer reaches the memory budget, then
+// sorted and written to a temporary file as a run.  The budget covers the
+// buffer's whole capacity and, roughly, the words' own heap storage, so
+// the buffer is spilled rather than grown past it.  At the end, the runs
+// are merged fan_in at a time until one last merge can write the groups
+// out in the same order and format as anagrams.  If the words all fit in
+// the budget nothing is written to disk at all.
+//
+// Runs are named after temp_prefix and removed once they're merged.
+class external_anagrams : boost::noncopyable
+{
+ public:
+  typedef const string& const_reference;
+
+  struct statistics
+  {
+    size_t n_words;          // Words inserted
+    size_t n_runs;           // Runs spilled from the buffer
+    size_t n_merged_runs;    // Runs written by intermediate merges
+    size_t n_passes;         // Merge passes, including the last
+    size_t peak_buffer;      // Most bytes buffered at once
+    uint64_t bytes_spilled;  // Bytes written to runs, all told
+  };
+
+ private:
+  struct record
+  {
+    word_signature sig;
+    string word;
+
+    record()
+      : sig(string())
+    {
+    }
+    record(const string& word)
+      : sig(word), word(word)
+    {
+    }
+
+    bool operator<(const record& r) const
+    {
+      return sig < r.sig || (sig == r.sig && word < r.word);
+    }
+  };
+
+  // One run being read back.  Records are the packed signature, the
+  // length of the word, then the word, in native byte order; an
+  // overflowed signature is worked out again from the word.
+  class run
+  {
+    ifstream f;
+    record r;
+
+  public:
+    run(const string& filename)
+      : f(filename.c_str(), ios::in | ios::binary)
+    {
+      if(!f) {
+        throw runtime_error("Cannot open anagram run " + filename);
+      }
+    }
+
+    bool next()
+    {
+      uint64_t key[2];
+      uint32_t length;
+      if(!f.read(reinterpret_cast<char *>(key), sizeof key)
+         || !f.read(reinterpret_cast<char *>(&length), sizeof length)) {
+        return false;
+      }
+      r.word.resize(length);
+      if(length != 0 && !f.read(&r.word[0], length)) {
+        return false;
+      }
+      r.sig = (key[1] & 1) ? word_signature(r.word)
+        : word_signature(key[0], key[1]);
+      return true;
+    }
+
+    const record& current() const
+    {
+      return r;
+    }
+  };
+
+  struct later
+  {
+    bool operator()(const shared_ptr<run>& a, const shared_ptr<run>& b) const
+    {
+      return b->current() < a->current();
+    }
+  };
+
+  // Writes records to a new run, dropping repeated words.
+  class run_writer
+  {
+    ofstream f;
+    record last;
+    bool empty;
+
+  public:
+    uint64_t bytes;
+
+    run_writer(const string& filename)
+      : f(filename.c_str(), ios::out | ios::binary), empty(true), bytes(0)
+    {
+      if(!f) {
+        throw runtime_error("Cannot write anagram run " + filename);
+      }
+    }
+
+    void operator()(const record& r)
+    {
+      if(!empty && r.word == last.word) {
+        return;
+      }
+      const uint64_t key[2] = { r.sig.high(), r.sig.low() };
+      const uint32_t length = r.word.size();
+      f.write(reinterpret_cast<const char *>(key), sizeof key);
+      f.write(reinterpret_cast<const char *>(&length), sizeof length);
+      f.write(r.word.data(), length);
+      bytes += sizeof key + sizeof length + length;
+      last = r;
+      empty = false;
+    }
+
+    void close()
+    {
+      f.close();
+      if(!f) {
+        throw runtime_error("Unable to write anagram run");
+      }
+    }
+  };
+
+  // Writes sorted records out as groups, as anagrams does.
+  class group_writer
+  {
+    ostream& s;
+    vector<string> words;
+    record last;
+
+  public:
+    group_writer(ostream& s)
+      : s(s)
+    {
+    }
+
+    void operator()(const record& r)
+    {
+      if(!words.empty() && r.sig == last.sig) {
+        if(r.word != words.back()) {
+          words.push_back(r.word);
+        }
+        return;
+      }
+      flush();
+      words.push_back(r.word);
+      last = r;
+    }
+
+    void flush()
+    {
+      if(words.size() > 1) {
+        s << words[0];
+        for(size_t i = 1; i < words.size(); i++) {
+          s << " " << words[i];
+        }
+        s << "...\n";
+      }
+      words.clear();
+    }
+  };
+
+  const string temp_prefix;
+  const size_t memory_budget;
+  const unsigned int fan_in;
+
+  vector<record> buffer;
+  size_t word_bytes; // Heap storage of the buffered words, roughly
+  vector<string> runs;
+  size_t next_run;
+  statistics stats;
+
+  // A string allocates its characters, a NUL and, for some libraries, a
+  // header of a few words, and malloc adds its own.  Overestimating is
+  // harmless: it just spills a little early.
+  static size_t heap_bytes(const string& w)
+  {
+    return w.size() + 1 + 4 * sizeof(size_t);
+  }
+
+  size_t buffered() const
+  {
+    return buffer.capacity() * sizeof(record) + word_bytes;
+  }
+
+  string run_name()
+  {
+    ostringstream name;
+    name << temp_prefix << ".run" << next_run++;
+    return name.str();
+  }
+
+  void spill()
+  {
+    sort(buffer.begin(), buffer.end());
+    const string name = run_name();
+    run_writer w(name);
+    for(vector<record>::const_iterator r = buffer.begin(); r != buffer.end();
+        r++) {
+      w(*r);
+    }
+    w.close();
+    runs.push_back(name);
+    stats.n_runs++;
+    stats.bytes_spilled += w.bytes;
+    buffer.clear();
+    word_bytes = 0;
+  }
+
+  template <class Sink>
+  void merge(vector<string>::const_iterator first,
+             vector<string>::const_iterator last, Sink& sink)
+  {
+    priority_queue<shared_ptr<run>, vector<shared_ptr<run> >, later> q;
+    for(vector<string>::const_iterator i = first; i != last; i++) {
+      shared_ptr<run> r(new run(*i));
+      if(r->next()) {
+        q.push(r);
+      }
+    }
+    while(!q.empty()) {
+      shared_ptr<run> r = q.top();
+      q.pop();
+      sink(r->current());
+      if(r->next()) {
+        q.push(r);
+      }
+    }
+    for(vector<string>::const_iterator i = first; i != last; i++) {
+      unlink(i->c_str());
+    }
+  }
+
+ public:
+  external_anagrams(const string& temp_prefix,
+                    size_t memory_budget = 64 << 20, unsigned int fan_in = 16)
+    : temp_prefix(temp_prefix), memory_budget(memory_budget), fan_in(fan_in),
+      word_bytes(0), next_run(0)
+  {
+    if(fan_in < 2) {
+      throw invalid_argument("Runs must be merged at least two at a time");
+    }
+    memset(&stats, 0, sizeof stats);
+  }
+
+  ~external_anagrams()
+  {
+    for(vector<string>::const_iterator i = runs.begin(); i != runs.end();
+        i++) {
+      unlink(i->c_str());
+    }
+  }
+
+  void insert(const string& w)
+  {
+    // The vector doubles its capacity when it's full.
+    if(buffer.size() == buffer.capacity() && !buffer.empty()
+       && buffer.capacity() * 2 * sizeof(record) + word_bytes + heap_bytes(w)
+          > memory_budget) {
+      spill();
+    }
+    buffer.push_back(record(w));
+    word_bytes += heap_bytes(w);
+    stats.n_words++;
+    stats.peak_buffer = max(stats.peak_buffer, buffered());
+    if(buffered() >= memory_budget) {
+      spill();
+    }
+  }
+  void push_back(const string& w)
+  {
+    insert(w);
+  }
+
+  // Write out every word inserted so far, grouped, and start again.
+  void write_out(ostream& s)
+  {
+    group_writer groups(s);
+    if(runs.empty()) {
+      sort(buffer.begin(), buffer.end());
+      for(vector<record>::const_iterator r = buffer.begin();
+          r != buffer.end(); r++) {
+        groups(*r);
+      }
+      groups.flush();
+      buffer.clear();
+      word_bytes = 0;
+      return;
+    }
+
+    if(!buffer.empty()) {
+      spill();
+    }
+    while(runs.size() > fan_in) {
+      vector<string> merged;
+      for(size_t i = 0; i < runs.size(); i += fan_in) {
+        const size_t end = min(i + fan_in, runs.size());
+        if(end - i == 1) {
+          merged.push_back(runs[i]);
+          continue;
+        }
+        const string name = run_name();
+        run_writer w(name);
+        merge(runs.begin() + i, runs.begin() + end, w);
+        w.close();
+        merged.push_back(name);
+        stats.n_merged_runs++;
+        stats.bytes_spilled += w.bytes;
+      }
+      runs.swap(merged);
+      stats.n_passes++;
+    }
+    merge(runs.begin(), runs.end(), groups);
+    groups.flush();
+    runs.clear();
+    stats.n_passes++;
+  }
+
+  const statistics& spill_statistics() const
+  {
+    return stats;
+  }
+};
+
+// On-disk anagram index, for answering "what are the anagrams of this
+// word?" without building anything at startup.  The file is this header,
+// followed by:
+//
+//   index_slot slots[n_slots];      Open-addressing table of signatures
+//   uint32_t group_start[n_groups + 1];  Each group's first word
+//   uint32_t word_offset[n_words];  Each word's offset in the arena
+//   char arena[arena_size];         NUL-terminated words
+//
+// Only groups of two or more words are stored.  A slot holds the hash of
+// a group's signature; a hit is confirmed by comparing the query's
+// signature with the group's first word's, so overflowed signatures work
+// too.  Everything is in native byte order, and the hashes are
+// word_signature::hash()'s, so bump the version if either changes.
+struct index_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t n_slots;
+  uint32_t n_groups;
+  uint32_t n_words;
+  uint64_t arena_size;
+};
+
+struct index_slot
+{
+  uint64_t hash;
+  uint32_t group;  // Group number + 1, or 0 if empty
+  uint32_t unused;
+};
+
+const char index_magic[8] = "KATA6AX";
+const uint32_t index_version = 1;
+
+void write_index(const anagrams& a, const string& filename)
+{
+  vector<uint32_t> group_start, word_offset;
+  vector<char> arena;
+  vector<index_slot> slots;
+  vector<uint64_t> hashes;
+
+  for(anagrams::iterator it = a.begin(); it != a.end(); it++) {
+    hashes.push_back(word_signature(*it->begin()).hash());
+    group_start.push_back(word_offset.size());
+    for(anagrams::word_list::const_iterator w = it->begin();
+        w != it->end(); w++) {
+      const string word = *w;
+      word_offset.push_back(arena.size());
+      arena.insert(arena.end(), word.begin(), word.end());
+      arena.push_back('\0');
+    }
+  }
+  const uint32_t n_groups = group_start.size();
+  group_start.push_back(word_offset.size());
+
+  // At most half full, so misses are short.
+  uint32_t n_slots = 16;
+  while(n_slots < n_groups * 2) {
+    n_slots <<= 1;
+  }
+  index_slot empty = { 0, 0, 0 };
+  slots.assign(n_slots, empty);
+  for(uint32_t g = 0; g < n_groups; g++) {
+    uint32_t i = hashes[g] & (n_slots - 1);
+    while(slots[i].group != 0) {
+      i = (i + 1) & (n_slots - 1);
+    }
+    slots[i].hash = hashes[g];
+    slots[i].group = g + 1;
+  }
+
+  index_header header;
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, index_magic, sizeof header.magic);
+  header.version = index_version;
+  header.n_slots = n_slots;
+  header.n_groups = n_groups;
+  header.n_words = word_offset.size();
+  header.arena_size = arena.size();
+
+  ofstream f(filename.c_str(), ios::binary | ios::trunc);
+  f.write(reinterpret_cast<const char *>(&header), sizeof header);
+  f.write(reinterpret_cast<const char *>(&slots[0]),
+          slots.size() * sizeof(index_slot));
+  f.write(reinterpret_cast<const char *>(&group_start[0]),
+          group_start.size() * sizeof(uint32_t));
+  if(!word_offset.empty()) {
+    f.write(reinterpret_cast<const char *>(&word_offset[0]),
+            word_offset.size() * sizeof(uint32_t));
+    f.write(&arena[0], arena.size());
+  }
+  if(!f) {
+    throw runtime_error("Unable to write anagram index to " + filename);
+  }
+}
+
+// A memory-mapped anagram index written by write_index().  Opening it
+// checks the file once over for anything a lookup would trust, and a
+// lookup touches a slot or two and the group it finds, straight out of
+// the page cache.
+class anagram_index : boost::noncopyable
+{
+  void *base;
+  size_t length;
+  const index_header *header;
+  const index_slot *slots;
+  const uint32_t *group_start;
+  const uint32_t *word_offset;
+  const char *arena;
+
+ public:
+  // The words in one group, pointing straight into the index.
+  class group
+  {
+    const char *arena;
+    const uint32_t *first, *last;
+
+  public:
+    group(const char *arena = 0, const uint32_t *first = 0,
+          const uint32_t *last = 0)
+      : arena(arena), first(first), last(last)
+    {
+    }
+
+    size_t size() const
+    {
+      return last - first;
+    }
+    bool empty() const
+    {
+      return first == last;
+    }
+    const char *operator[](size_t i) const
+    {
+      return arena + first[i];
+    }
+  };
+
+  anagram_index(const string& filename)
+  {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+      throw runtime_error("Cannot open anagram index " + filename);
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < off_t(sizeof(index_header))) {
+      close(fd);
+      throw runtime_error("Anagram index " + filename + " is truncated");
+    }
+    length = st.st_size;
+    base = mmap(0, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+      throw runtime_error("Cannot map anagram index " + filename);
+    }
+
+    // Check the header before working out where anything else is from it.
+    // The slots are used as a hash table, so there must be a power of two
+    // of them with at least one empty.
+    header = static_cast<const index_header *>(base);
+    const uint32_t n_slots = header->n_slots;
+    if(memcmp(header->magic, index_magic, sizeof header->magic) != 0
+       || header->version != index_version
+       || n_slots == 0 || (n_slots & (n_slots - 1)) != 0
+       || header->n_groups >= n_slots
+       || header->arena_size > length
+       || sizeof(index_header) + uint64_t(n_slots) * sizeof(index_slot)
+          + (uint64_t(header->n_groups) + 1 + header->n_words)
+            * sizeof(uint32_t)
+          + header->arena_size != length) {
+      munmap(base, length);
+      throw runtime_error(filename + " is not a usable anagram index");
+    }
+    slots = reinterpret_cast<const index_slot *>(header + 1);
+    group_start = reinterpret_cast<const uint32_t *>(slots + n_slots);
+    word_offset = group_start + header->n_groups + 1;
+    arena = reinterpret_cast<const char *>(word_offset + header->n_words);
+    if(!well_formed()) {
+      munmap(base, length);
+      throw runtime_error(filename + " is not a usable anagram index");
+    }
+  }
+
+  ~anagram_index()
+  {
+    munmap(base, length);
+  }
+
+ private:
+  // Everything lookup() relies on: every slot's group exists and at least
+  // one slot is empty, every group has words and they're within the list,
+  // and every word starts within the arena, whose last byte ends a word.
+  bool well_formed() const
+  {
+    bool empty_slot = false;
+    for(uint32_t i = 0; i < header->n_slots; i++) {
+      if(slots[i].group > header->n_groups) {
+        return false;
+      }
+      empty_slot |= slots[i].group == 0;
+    }
+    if(!empty_slot) {
+      return false;
+    }
+
+    for(uint32_t g = 0; g < header->n_groups; g++) {
+      if(group_start[g] >= group_start[g + 1]) {
+        return false;
+      }
+    }
+    if(group_start[header->n_groups] > header->n_words) {
+      return false;
+    }
+
+    if(header->n_words != 0 && (header->arena_size == 0
+                                || arena[header->arena_size - 1] != '\0')) {
+      return false;
+    }
+    for(uint32_t w = 0; w < header->n_words; w++) {
+      if(word_offset[w] >= header->arena_size) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ public:
+
+  // All the words in the index which are anagrams of word (including
+  // word itself, if it's there), or an empty group if there are none.
+  group lookup(const string& word) const
+  {
+    const word_signature sig(word);
+    const uint64_t h = sig.hash();
+    const uint32_t mask = header->n_slots - 1;
+    for(uint32_t i = h & mask; slots[i].group != 0; i = (i + 1) & mask) {
+      if(slots[i].hash != h) {
+        continue;
+      }
+      const uint32_t g = slots[i].group - 1;
+      if(word_signature(arena + word_offset[group_start[g]]) == sig) {
+        return group(arena, word_offset + group_start[g],
+                     word_offset + group_start[g + 1]);
+      }
+    }
+    return group();
+  }
+
+  size_t size() const
+  {
+    return header->n_groups;
+  }
+};
+
+// Finds the words, and combinations of up to a few words, which can be
+// made from a given set of letters.  Words are grouped by signature, and
+// each group's letter counts are kept in one dense array alongside a
+// 26-bit mask of which letters it uses, so most groups are rejected by a
+// single mask test.  Combinations are found by a depth-first search which
+// only picks groups in increasing order (so each combination is found
+// once), and which finds the last word of a combination by looking up the
+// exact letters remaining rather than by searching.
+//
+// Only the letters a to z fit the dense counts, so words with any other
+// letter (those with Unicode signatures) are left out of the search, and
+// any other letters given to search with are ignored by find_words() and
+// make find_phrases() find nothing, as they can't be used up.
+class anagram_search
+{
+ public:
+  typedef vector<string> word_set;          // Anagrams of each other
+  typedef vector<const word_set*> phrase;   // One word from each
+
+ private:
+  static const unsigned int n_letters = 26;
+
+  vector<word_set> groups;
+  vector<uint32_t> masks;
+  vector<unsigned int> lengths;
+  vector<unsigned char> counts;             // n_letters per group
+  map<word_signature, uint32_t> by_signature;
+
+  // Returns the number of letters, ignoring any beyond a to z.
+  static unsigned int count_letters(const string& w, unsigned int *c,
+                                    uint32_t& mask)
+  {
+    fill(c, c + n_letters, 0);
+    mask = 0;
+    unsigned int n = 0;
+    for(string::const_iterator it = w.begin(); it != w.end(); it++) {
+      const unsigned char ch = *it;
+      if(ch >= 0x80 || !isalpha(ch)) {
+        continue;
+      }
+      const unsigned int l = ch - (islower(ch) ? 'a' : 'A');
+      c[l]++;
+      mask |= 1U << l;
+      n++;
+    }
+    return n;
+  }
+
+  bool fits(uint32_t g, const unsigned int *c, uint32_t mask,
+            unsigned int length) const
   {
-    insert(w);
+    if((masks[g] & ~mask) != 0 || lengths[g] > length) {
+      return false;
+    }
+    const unsigned char *gc = &counts[g * n_letters];
+    for(unsigned int l = 0; l < n_letters; l++) {
+      if(gc[l] > c[l]) {
+        return false;
+      }
+    }
+    return true;
   }
 
-  iterator begin() const
+  void search(unsigned int *c, uint32_t mask, unsigned int length,
+              const vector<uint32_t>& candidates, size_t start,
+              unsigned int words_left, phrase& current,
+              vector<phrase>& out) const
   {
-    return iterator(*this, al.begin());
+    if(length == 0) {
+      out.push_back(current);
+      return;
+    }
+    if(words_left == 0 || start == candidates.size()) {
+      return;
+    }
+
+    if(words_left == 1) {
+      string rest;
+      for(unsigned int l = 0; l < n_letters; l++) {
+        rest.append(c[l], 'a' + l);
+      }
+      map<word_signature, uint32_t>::const_iterator g
+        = by_signature.find(word_signature(rest));
+      if(g != by_signature.end() && g->second >= candidates[start]) {
+        current.push_back(&groups[g->second]);
+        out.push_back(current);
+        current.pop_back();
+      }
+      return;
+    }
+
+    for(size_t i = start; i < candidates.size(); i++) {
+      const uint32_t g = candidates[i];
+      if(!fits(g, c, mask, length)) {
+        continue;
+      }
+      const unsigned char *gc = &counts[g * n_letters];
+      uint32_t rest_mask = 0;
+      for(unsigned int l = 0; l < n_letters; l++) {
+        c[l] -= gc[l];
+        rest_mask |= (c[l] != 0) << l;
+      }
+      current.push_back(&groups[g]);
+      search(c, rest_mask, length - lengths[g], candidates, i,
+             words_left - 1, current, out);
+      current.pop_back();
+      for(unsigned int l = 0; l < n_letters; l++) {
+        c[l] += gc[l];
+      }
+    }
   }
 
-  iterator end() const
+ public:
+  template <class InputIterator>
+  anagram_search(InputIterator first, InputIterator last)
   {
-    return iterator(*this, al.end());
+    for(; first != last; ++first) {
+      const word_signature sig(*first);
+      if(sig.unicode()) {
+        continue;
+      }
+      map<word_signature, uint32_t>::iterator g = by_signature.find(sig);
+      if(g == by_signature.end()) {
+        unsigned int c[n_letters];
+        uint32_t mask;
+        const unsigned int length = count_letters(*first, c, mask);
+        if(length == 0) {
+          continue;
+        }
+        g = by_signature.insert(make_pair(sig, groups.size())).first;
+        groups.push_back(word_set());
+        masks.push_back(mask);
+        lengths.push_back(length);
+        for(unsigned int l = 0; l < n_letters; l++) {
+          counts.push_back(min(c[l], 255U));
+        }
+      }
+      word_set& words = groups[g->second];
+      if(find(words.begin(), words.end(), *first) == words.end()) {
+        words.push_back(*first);
+      }
+    }
   }
 
-  size_t size() const
+  // Every group of words which can be made from some of the letters.
+  vector<const word_set*> find_words(const string& letters) const
   {
-    return count_if(begin(), end(),
-                    compose_f_gx(bind2nd(greater<size_t>(), 1),
-                                 mem_fun_ref(&word_list::size)));
+    unsigned int c[n_letters];
+    uint32_t mask;
+    const unsigned int length = count_letters(letters, c, mask);
+    vector<const word_set*> out;
+    for(uint32_t g = 0; g < groups.size(); g++) {
+      if(fits(g, c, mask, length)) {
+        out.push_back(&groups[g]);
+      }
+    }
+    return out;
   }
 
-  friend ostream& operator<<(ostream& s, const anagrams& a)
+  // Every combination of up to max_words words which uses exactly all
+  // the letters.  Each combination is found once, whatever order its
+  // words come in.
+  vector<phrase> find_phrases(const string& letters,
+                              unsigned int max_words = 3) const
   {
-    // FIXME: Why doesn't the copy() version work?
-    // copy(a.begin(), a.end(), ostream_iterator<word_list>(s, "\n"));
-    for(iterator it = a.begin(); it != a.end(); it++) {
-      s << *it << "..." << endl;
+    if(word_signature(letters).unicode()) {
+      return vector<phrase>();
     }
-    return s;
+    unsigned int c[n_letters];
+    uint32_t mask;
+    const unsigned int length = count_letters(letters, c, mask);
+
+    vector<uint32_t> candidates;
+    for(uint32_t g = 0; g < groups.size(); g++) {
+      if(fits(g, c, mask, length)) {
+        candidates.push_back(g);
+      }
+    }
+
+    vector<phrase> out;
+    phrase current;
+    if(length != 0) {
+      search(c, mask, length, candidates, 0, max_words, current, out);
+    }
+    return out;
   }
-};
 
-ostream& operator<<(ostream& s, const anagrams::word_list& l)
-{
-  set<string>::const_iterator j = l.begin();
-  s << *j;
-  while(++j != l.end()) {
-    s << " " << *j;
+  size_t size() const
+  {
+    return groups.size();
   }
-  return s;
-}
+};
+
+#ifndef KATA6_BENCHMARK
 
 // Test functions
 void test_word_rep()
@@ -318,6 +2223,95 @@ void test_word_rep()
   BOOST_CHECK(rots < knits);
 }
 
+void test_word_signature()
+{
+  const string l[] = { "kinship", "pinkish", "enlist", "inlets", "listen",
+                       "silent", "boaster", "boaters", "borates", "fresher",
+                       "refresh", "sinks", "skins", "knits", "stink", "rots",
+                       "sort", "Zoo", "zygote",
+                       // Too many 'a's or 'z's to pack.
+                       "aaaaaaaaaaaaaaaabc", "cbaaaaaaaaaaaaaaaa",
+                       "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+                       "zzzzzzzzzzzzzzzzz" };
+  const size_t l_sz = sizeof l / sizeof *l;
+
+  BOOST_CHECK(!word_signature("kinship").overflowed());
+  BOOST_CHECK(word_signature("aaaaaaaaaaaaaaaabc").overflowed());
+
+  // Must agree with word_rep on equality and ordering, which is what the
+  // anagram groups (and their order) are defined by.
+  for(size_t i = 0; i < l_sz; i++) {
+    for(size_t j = 0; j < l_sz; j++) {
+      const word_rep ri(l[i]), rj(l[j]);
+      const word_signature si(l[i]), sj(l[j]);
+      BOOST_CHECK_EQUAL(si == sj, ri == rj);
+      BOOST_CHECK_EQUAL(si < sj, ri < rj);
+      if(si == sj) {
+        BOOST_CHECK_EQUAL(si.hash(), sj.hash());
+      }
+    }
+  }
+}
+
+void test_unicode_signature()
+{
+  const string l[] = { "cafe", "face", "caf\xc3\xa9", "F\xc3\x89" "CA",
+                       "\xc3\xa9" "cafe",
+                       // "Kot" and "tok" in Cyrillic.
+                       "\xd0\x9a\xd0\xbe\xd1\x82",
+                       "\xd1\x82\xd0\xbe\xd0\xba",
+                       // Greek sigma, capital, small and final.
+                       "\xce\xa3\xce\xb1", "\xce\xb1\xcf\x83",
+                       "\xce\xb1\xcf\x82",
+                       // Latin Extended-A: "Lodz", "dzlo" and "Z dot".
+                       "\xc5\x81\xc3\xb3" "dz", "dz\xc5\x82\xc3\xb3",
+                       "\xc5\xbb", "\xc5\xbc" };
+  const size_t l_sz = sizeof l / sizeof *l;
+
+  BOOST_CHECK(!word_signature("cafe").overflowed());
+  BOOST_CHECK(word_signature("caf\xc3\xa9").overflowed());
+  BOOST_CHECK(word_signature("caf\xc3\xa9") != word_signature("face"));
+  BOOST_CHECK(word_signature("caf\xc3\xa9")
+              == word_signature("F\xc3\x89" "CA"));
+  BOOST_CHECK(word_signature("\xd0\x9a\xd0\xbe\xd1\x82")
+              == word_signature("\xd1\x82\xd0\xbe\xd0\xba"));
+  BOOST_CHECK(word_signature("\xce\xa3\xce\xb1")
+              == word_signature("\xce\xb1\xcf\x82"));
+  BOOST_CHECK(word_signature("\xc5\x81\xc3\xb3" "dz")
+              == word_signature("dz\xc5\x82\xc3\xb3"));
+  BOOST_CHECK(word_signature("\xc5\xbb") == word_signature("\xc5\xbc"));
+  BOOST_CHECK_EQUAL(word_signature("\xc3\xa9" "cafe").length(), 5U);
+  // Different numbers of distinct letters, both ways round.
+  BOOST_CHECK(word_signature("caf\xc3\xa9") != word_signature("\xc3\xa9"));
+  BOOST_CHECK(word_signature("\xc3\xa9") != word_signature("caf\xc3\xa9"));
+
+  // Punctuation (here an em dash) and invalid bytes don't count, and a
+  // word with no other letters is still packed.
+  const skip_counts before = skipped;
+  BOOST_CHECK(word_signature("co\xe2\x80\x94op") == word_signature("coop"));
+  BOOST_CHECK(!word_signature("co\xe2\x80\x94op").overflowed());
+  BOOST_CHECK(word_signature("co\xffop\xc3") == word_signature("coop"));
+  BOOST_CHECK_EQUAL(skipped.words - before.words, 3U);
+  BOOST_CHECK_EQUAL(skipped.characters - before.characters, 2U);
+  BOOST_CHECK_EQUAL(skipped.invalid - before.invalid, 2U);
+
+  // The order must be a strict weak ordering consistent with equality.
+  for(size_t i = 0; i < l_sz; i++) {
+    for(size_t j = 0; j < l_sz; j++) {
+      const word_signature si(l[i]), sj(l[j]);
+      BOOST_CHECK_EQUAL(si == sj, !(si < sj) && !(sj < si));
+      BOOST_CHECK(!(si < sj && sj < si));
+      if(si == sj) {
+        BOOST_CHECK_EQUAL(si.hash(), sj.hash());
+      }
+    }
+  }
+
+  anagrams a;
+  copy(l, l + l_sz, back_inserter(a));
+  BOOST_CHECK_EQUAL(a.size(), 6U);
+}
+
 void test_anagrams()
 {
   const string l[] = { "kinship", "pinkish",
@@ -326,29 +2320,151 @@ void test_anagrams()
                        "fresher", "refresh",
                        "sinks", "skins",
                        "knits", "stink",
-                       "rots", "sort" };
+                       "rots", "sort", "a", "lonely", "zzz" };
   const size_t l_sz = sizeof l / sizeof *l;
   anagrams a;
 
   copy(l, l + l_sz, back_inserter(a));
 
+  BOOST_CHECK_EQUAL(a.size(), 7U);
+  BOOST_CHECK_EQUAL(static_cast<size_t>(distance(a.begin(), a.end())),
+                    a.size());
+  BOOST_CHECK_EQUAL(*a.largest_group().begin(), "enlist");
+  BOOST_CHECK_EQUAL(a.longest_anagram().size(), 2U);
+  BOOST_CHECK_EQUAL(a.longest_anagram().begin()->size(), 7U);
+  BOOST_CHECK_EQUAL(a.find("Tinsel")->size(), 4U);
+  BOOST_CHECK(a.find("lonely") == 0);
+  BOOST_CHECK(a.find("xyzzy") == 0);
+
   for(anagrams::iterator it = a.begin(); it != a.end(); it++) {
+    BOOST_CHECK(it->size() > 1);
     word_rep first(*it->begin());
-    for(set<string>::const_iterator jt = it->begin(); jt != it->end(); jt++) {
+    for(anagrams::word_list::const_iterator jt = it->begin();
+        jt != it->end(); jt++) {
       BOOST_CHECK(first == word_rep(*jt));
     }
   }
 }
 
-template<typename F>
-struct first_element_functor
-  : public unary_function<F, typename F::value_type>
+void test_batch_anagrams()
 {
-  typename first_element_functor<F>::result_type operator()(typename first_element_functor<F>::argument_type x) const
-  {
-    return *x.begin();
+  const string l[] = { "kinship", "pinkish",
+                       "enlist", "inlets", "listen", "silent",
+                       "boaster", "boaters", "borates",
+                       "fresher", "refresh",
+                       "sinks", "skins", "sinks",
+                       "knits", "stink", "Stink",
+                       "rots", "sort", "lonely",
+                       "aaaaaaaaaaaaaaaabc", "cbaaaaaaaaaaaaaaaa",
+                       "zzzzzzzzzzzzzzzzz" };
+  const vector<string> words(l, l + sizeof l / sizeof *l);
+  anagrams a;
+  copy(words.begin(), words.end(), back_inserter(a));
+  batch_anagrams b(words);
+
+  BOOST_CHECK_EQUAL(b.size(), a.size());
+  ostringstream incremental, batch;
+  incremental << a;
+  batch << b;
+  BOOST_CHECK_EQUAL(batch.str(), incremental.str());
+}
+
+void test_external_anagrams()
+{
+  const string l[] = { "kinship", "pinkish",
+                       "enlist", "inlets", "listen", "silent",
+                       "boaster", "boaters", "borates",
+                       "fresher", "refresh",
+                       "sinks", "skins", "sinks",
+                       "knits", "stink", "Stink",
+                       "rots", "sort", "lonely", "inlets",
+                       "aaaaaaaaaaaaaaaabc", "cbaaaaaaaaaaaaaaaa",
+                       "zzzzzzzzzzzzzzzzz" };
+  const size_t l_sz = sizeof l / sizeof *l;
+  anagrams a;
+  copy(l, l + l_sz, back_inserter(a));
+  ostringstream expected;
+  expected << a;
+
+  // Everything in memory.
+  external_anagrams in_memory("test_external");
+  copy(l, l + l_sz, back_inserter(in_memory));
+  ostringstream out;
+  in_memory.write_out(out);
+  BOOST_CHECK_EQUAL(out.str(), expected.str());
+  BOOST_CHECK_EQUAL(in_memory.spill_statistics().n_runs, 0U);
+
+  // A run every few words, merged two at a time.
+  external_anagrams spilled("test_external", 4 * sizeof(string) * 4, 2);
+  copy(l, l + l_sz, back_inserter(spilled));
+  ostringstream merged;
+  spilled.write_out(merged);
+  BOOST_CHECK_EQUAL(merged.str(), expected.str());
+
+  const external_anagrams::statistics& stats = spilled.spill_statistics();
+  BOOST_CHECK_EQUAL(stats.n_words, l_sz);
+  BOOST_CHECK(stats.n_runs > 2);
+  BOOST_CHECK(stats.n_passes > 1);
+  BOOST_CHECK(stats.peak_buffer <= 4 * sizeof(string) * 4 + 256);
+
+  BOOST_CHECK_THROW(external_anagrams("test_external", 1024, 1),
+                    invalid_argument);
+}
+
+bool contains(const vector<const anagram_search::word_set*>& groups,
+              const string& w)
+{
+  for(size_t i = 0; i < groups.size(); i++) {
+    if(find(groups[i]->begin(), groups[i]->end(), w) != groups[i]->end()) {
+      return true;
+    }
   }
-};
+  return false;
+}
+
+void test_anagram_search()
+{
+  const string l[] = { "listen", "silent", "enlist", "list", "slit", "ten",
+                       "net", "lit", "tile", "nest", "sent", "lien", "in",
+                       "lets", "tins", "le", "zebra", "tentative" };
+  anagram_search s(l, l + sizeof l / sizeof *l);
+
+  const vector<const anagram_search::word_set*> words = s.find_words("Silent");
+  BOOST_CHECK(contains(words, "listen"));
+  BOOST_CHECK(contains(words, "list"));
+  BOOST_CHECK(contains(words, "lien"));
+  BOOST_CHECK(contains(words, "in"));
+  BOOST_CHECK(!contains(words, "zebra"));
+  BOOST_CHECK(!contains(words, "tentative"));
+
+  // "listen", "in" + "lets" and "le" + "tins".
+  const vector<anagram_search::phrase> phrases = s.find_phrases("silent", 3);
+  set<set<string> > found;
+  for(size_t i = 0; i < phrases.size(); i++) {
+    set<string> p;
+    string letters;
+    for(size_t j = 0; j < phrases[i].size(); j++) {
+      p.insert(phrases[i][j]->front());
+      letters += phrases[i][j]->front();
+    }
+    BOOST_CHECK(word_rep(letters) == word_rep("silent"));
+    BOOST_CHECK(found.insert(p).second); // Each found only once
+  }
+  BOOST_CHECK_EQUAL(found.size(), 3U);
+
+  BOOST_CHECK(s.find_phrases("silent", 1).size() == 1);
+  BOOST_CHECK(s.find_phrases("qqq").empty());
+
+  // Words with letters beyond a to z aren't searched.
+  const string u[] = { "caf\xc3\xa9", "face", "caf" };
+  anagram_search us(u, u + sizeof u / sizeof *u);
+  BOOST_CHECK_EQUAL(us.size(), 2U);
+  BOOST_CHECK(contains(us.find_words("caf"), "caf"));
+  BOOST_CHECK(!contains(us.find_words("caf"), "caf\xc3\xa9"));
+  BOOST_CHECK(contains(us.find_words("caf\xc3\xa9"), "caf"));
+  BOOST_CHECK(us.find_phrases("caf\xc3\xa9").empty());
+  BOOST_CHECK_EQUAL(us.find_phrases("face").size(), 1U);
+}
 
 class test_dictionary
 {
@@ -372,13 +2488,175 @@ class test_dictionary
   void load()
   {
     BOOST_MESSAGE("Retrieving dictionary " << in_file << "...");
+    const skip_counts before = skipped;
     ifstream f(in_file.c_str());
     copy(istream_iterator<string>(f), istream_iterator<string>(),
          back_inserter(a));
+    BOOST_MESSAGE(skipped.words - before.words << " words in " << in_file
+                  << " had " << skipped.characters - before.characters
+                  << " non-letters and " << skipped.invalid - before.invalid
+                  << " invalid UTF-8 bytes ignored.");
 
     BOOST_CHECK_EQUAL(a.size(), expected_groups);
   }
 
+  // Build the same anagrams again in parallel: it must come out exactly
+  // the same.
+  void load_parallel()
+  {
+    ifstream f(in_file.c_str());
+    vector<string> words;
+    copy(istream_iterator<string>(f), istream_iterator<string>(),
+         back_inserter(words));
+
+    anagrams p;
+    p.insert(words, 4);
+    BOOST_CHECK_EQUAL(p.size(), a.size());
+    BOOST_CHECK_EQUAL(p.size(), expected_groups);
+
+    ostringstream serial, parallel;
+    serial << a;
+    parallel << p;
+    BOOST_CHECK(serial.str() == parallel.str());
+    BOOST_CHECK(*p.largest_group().begin() == *a.largest_group().begin());
+    BOOST_CHECK(*p.longest_anagram().begin() == *a.longest_anagram().begin());
+  }
+
+  // Group the same words in one go: the groups must match.
+  void group_batch()
+  {
+    ifstream f(in_file.c_str());
+    vector<string> words;
+    copy(istream_iterator<string>(f), istream_iterator<string>(),
+         back_inserter(words));
+
+    batch_anagrams b(words);
+    BOOST_CHECK_EQUAL(b.size(), a.size());
+
+    ostringstream incremental, batch;
+    incremental << a;
+    batch << b;
+    BOOST_CHECK(incremental.str() == batch.str());
+  }
+
+  // Group the same words with a small memory budget, spilling to disk:
+  // the output must match.
+  void group_external()
+  {
+    external_anagrams e(out_file, 256 << 10, 4);
+    ifstream f(in_file.c_str());
+    copy(istream_iterator<string>(f), istream_iterator<string>(),
+         back_inserter(e));
+
+    ostringstream incremental, external;
+    incremental << a;
+    e.write_out(external);
+    BOOST_CHECK(incremental.str() == external.str());
+
+    const external_anagrams::statistics& stats = e.spill_statistics();
+    BOOST_CHECK(stats.peak_buffer <= (256 << 10) + 256);
+    BOOST_MESSAGE(in_file << ": " << stats.n_words << " words spilled to "
+                  << stats.n_runs << " runs, merged in " << stats.n_passes
+                  << " passes (" << stats.n_merged_runs
+                  << " intermediate runs), " << stats.bytes_spilled
+                  << " bytes written, at most " << stats.peak_buffer
+                  << " bytes buffered.");
+  }
+
+  // Write an index, open it, and check every group can be found from
+  // each of its words.
+  void save_index()
+  {
+    const string index_file = out_file + ".idx";
+    write_index(a, index_file);
+    anagram_index idx(index_file);
+    BOOST_CHECK_EQUAL(idx.size(), a.size());
+
+    for(anagrams::iterator it = a.begin(); it != a.end(); it++) {
+      for(anagrams::word_list::const_iterator w = it->begin();
+          w != it->end(); w++) {
+        const anagram_index::group g = idx.lookup(*w);
+        BOOST_CHECK_EQUAL(g.size(), it->size());
+        size_t i = 0;
+        for(anagrams::word_list::const_iterator x = it->begin();
+            x != it->end() && i < g.size(); x++, i++) {
+          BOOST_CHECK_EQUAL(*x, g[i]);
+        }
+      }
+    }
+    BOOST_CHECK(idx.lookup("zzzzqqqq").empty());
+
+    // A damaged header is refused before it's used to find anything.
+    const uint32_t bad_slots[] = { 0, 3, 1U << 30 };
+    for(size_t i = 0; i < sizeof bad_slots / sizeof *bad_slots; i++) {
+      fstream f(index_file.c_str(), ios::in | ios::out | ios::binary);
+      index_header h;
+      f.read(reinterpret_cast<char *>(&h), sizeof h);
+      h.n_slots = bad_slots[i];
+      f.seekp(0);
+      f.write(reinterpret_cast<const char *>(&h), sizeof h);
+      f.close();
+      BOOST_CHECK_THROW(anagram_index bad(index_file), runtime_error);
+    }
+
+    // So is one whose slots or words point astray: a slot for a group
+    // which isn't there, every slot full, and a last word left open.
+    for(unsigned int damage = 0; damage < 3; damage++) {
+      write_index(a, index_file);
+      fstream f(index_file.c_str(), ios::in | ios::out | ios::binary);
+      index_header h;
+      f.read(reinterpret_cast<char *>(&h), sizeof h);
+      const index_slot full = { 0, damage == 0 ? h.n_groups + 1 : 1, 0 };
+      if(damage < 2) {
+        for(uint32_t i = 0; i < (damage == 0 ? 1 : h.n_slots); i++) {
+          f.write(reinterpret_cast<const char *>(&full), sizeof full);
+        }
+      } else {
+        f.seekp(-1, ios::end);
+        f.put('x');
+      }
+      f.close();
+      BOOST_CHECK_THROW(anagram_index bad(index_file), runtime_error);
+    }
+    write_index(a, index_file);
+    BOOST_CHECK_EQUAL(anagram_index(index_file).size(), a.size());
+  }
+
+  // Multi-word anagrams of the longest anagram, timed.
+  void search_phrases()
+  {
+    ifstream f(in_file.c_str());
+    const anagram_search s((istream_iterator<string>(f)),
+                           istream_iterator<string>());
+
+    const clock_t start = clock();
+    const vector<anagram_search::phrase> phrases
+      = s.find_phrases(expected_longest_anagram, 2);
+    const double ms = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+    BOOST_MESSAGE(phrases.size() << " one and two word anagrams of "
+                  << expected_longest_anagram << " in " << in_file
+                  << " found in " << ms << "ms.");
+
+    // Each must use exactly the letters, and be found once; and there
+    // must be more than the word itself.
+    const word_signature sig(expected_longest_anagram);
+    set<anagram_search::phrase> found;
+    size_t two_words = 0;
+    for(size_t i = 0; i < phrases.size(); i++) {
+      string letters;
+      for(size_t j = 0; j < phrases[i].size(); j++) {
+        letters += phrases[i][j]->front();
+      }
+      BOOST_CHECK(word_signature(letters) == sig);
+      anagram_search::phrase p(phrases[i]);
+      sort(p.begin(), p.end());
+      BOOST_CHECK(found.insert(p).second);
+      two_words += phrases[i].size() == 2;
+    }
+    BOOST_CHECK(two_words > 0);
+  }
+
   void write_out()
   {
     ofstream f(out_file.c_str());
@@ -387,38 +2665,22 @@ class test_dictionary
 
   void find_largest_group()
   {
-    anagrams::iterator l = a.begin();
-    for(anagrams::iterator it = a.begin();
-        it != a.end();
-        it = find_if(++it, a.end(),
-                     compose_f_gx(bind2nd(greater<size_t>(), l->size()),
-                                  mem_fun_ref(&anagrams::word_list::size)))) {
-      l = it;
-    }
+    const anagrams::word_list& l = a.largest_group();
     cout << "Largest group (" << in_file << "): ";
-    copy(l->begin(), l->end(), ostream_iterator<string>(cout, " "));
+    copy(l.begin(), l.end(), ostream_iterator<string>(cout, " "));
     cout << endl;
-    BOOST_CHECK_EQUAL(word_rep(expected_largest_group), word_rep(*l->begin()));
+    BOOST_CHECK_EQUAL(word_rep(expected_largest_group), word_rep(*l.begin()));
   }
 
   void find_longest_anagram()
   {
-    anagrams::iterator l = a.begin();
-    for(anagrams::iterator it = a.begin();
-        it != a.end();
-        it = find_if(++it, a.end(),
-                     compose_f_gx(bind2nd(greater<size_t>(),
-                                          l->begin()->size()),
-                                  compose_f_gx(mem_fun_ref(&string::size),
-                                               first_element_functor<anagrams::word_list>())))) {
-      l = it;
-    }
+    const anagrams::word_list& l = a.longest_anagram();
     cout << "Longest anagram (" << in_file << "): ";
-    copy(l->begin(), l->end(), ostream_iterator<string>(cout, " "));
+    copy(l.begin(), l.end(), ostream_iterator<string>(cout, " "));
     cout << endl;
 
     BOOST_CHECK_EQUAL(word_rep(expected_longest_anagram),
-                      word_rep(*l->begin()));
+                      word_rep(*l.begin()));
   }
 };
 
@@ -426,7 +2688,12 @@ test_suite *init_unit_test_suite(int argc, char *argv[])
 {
   test_suite *t = BOOST_TEST_SUITE("Code Kata 6: Anagrams");
   t->add(BOOST_TEST_CASE(test_word_rep));
+  t->add(BOOST_TEST_CASE(test_word_signature));
+  t->add(BOOST_TEST_CASE(test_unicode_signature));
   t->add(BOOST_TEST_CASE(test_anagrams));
+  t->add(BOOST_TEST_CASE(test_batch_anagrams));
+  t->add(BOOST_TEST_CASE(test_external_anagrams));
+  t->add(BOOST_TEST_CASE(test_anagram_search));
 
   shared_ptr<test_dictionary> kata_dict(new test_dictionary("wordlist.txt",
                                                             "wordlist.out",
@@ -439,12 +2706,22 @@ test_suite *init_unit_test_suite(int argc, char *argv[])
                                                             "organ",
                                                             "cholecystoduodenostomy"));
   t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::load, kata_dict));
+  t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::load_parallel, kata_dict));
+  t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::group_batch, kata_dict));
+  t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::group_external, kata_dict));
+  t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::save_index, kata_dict));
+  t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::search_phrases, kata_dict));
   t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::write_out, kata_dict));
   t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::find_largest_group,
                                kata_dict));
   t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::find_longest_anagram,
                                kata_dict));
   t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::load, main_dict));
+  t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::load_parallel, main_dict));
+  t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::group_batch, main_dict));
+  t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::group_external, main_dict));
+  t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::save_index, main_dict));
+  t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::search_phrases, main_dict));
   t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::write_out, main_dict));
   t->add(BOOST_CLASS_TEST_CASE(&test_dictionary::find_largest_group,
                                main_dict));
@@ -453,3 +2730,383 @@ test_suite *init_unit_test_suite(int argc, char *argv[])
 
   return t;
 }
+
+#else // KATA6_BENCHMARK
+
+// Benchmark functions
+
+// Build with -DKATA6_BENCHMARK (make kata6_bench) for a program which
+// compares the ways of grouping anagrams above on synthetic dictionaries
+// of 10K, 100K, ... words, up to max_words.  Each line of its
+// tab-separated output gives, for one backend and size: the build time,
+// the peak RSS of the process, the memory used per word (or, for
+// anagram_index, the size of the index file per word), the time to look
+// up the group of a word, how fast the groups are written out, and how
+// many groups there are.  Each backend runs in its own process, so its
+// peak RSS is its own.  The same seed always generates the same words.
+//
+// Usage: kata6_bench [max_words [seed [output_file]]]
+
+// Words with roughly English letter frequencies and dictionary word
+// lengths.  Some are reshuffles of an earlier word, so there are groups
+// of anagrams to find, and some are repeats.  Uses xorshift64*, so runs
+// are reproducible whatever rand() does.
+class dictionary_generator
+{
+  uint64_t state;
+  vector<char> letters;         // Weighted by frequency
+  vector<unsigned int> lengths; // Likewise
+
+  uint64_t next()
+  {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dULL;
+  }
+
+ public:
+  dictionary_generator(uint64_t seed)
+    : state(seed ? seed : 1)
+  {
+    // Per thousand letters, a to z.
+    static const unsigned int letter_weights[] = {
+      82, 15, 28, 43, 127, 22, 20, 61, 70, 2, 8, 40, 24,
+      67, 75, 19, 1, 60, 63, 91, 28, 10, 24, 2, 20, 1
+    };
+    // Per thousand words, of 2 to 20 letters.
+    static const unsigned int length_weights[] = {
+      5, 25, 50, 85, 120, 140, 140, 125, 100, 75, 50, 35, 20, 12, 7, 4, 2,
+      1, 1
+    };
+    for(unsigned int l = 0; l < 26; l++) {
+      letters.insert(letters.end(), letter_weights[l], 'a' + l);
+    }
+    for(unsigned int i = 0;
+        i < sizeof length_weights / sizeof *length_weights; i++) {
+      lengths.insert(lengths.end(), length_weights[i], 2 + i);
+    }
+  }
+
+  vector<string> operator()(size_t n_words)
+  {
+    vector<string> words;
+    words.reserve(n_words);
+    while(words.size() < n_words) {
+      const unsigned int kind = next() % 100;
+      if(kind < 15 && !words.empty()) {
+        string w = words[next() % words.size()];
+        for(size_t i = w.size(); i > 1; i--) {
+          swap(w[i - 1], w[next() % i]);
+        }
+        words.push_back(w);
+      } else if(kind < 20 && !words.empty()) {
+        words.push_back(words[next() % words.size()]);
+      } else {
+        string w(lengths[next() % lengths.size()], 'a');
+        for(size_t i = 0; i < w.size(); i++) {
+          w[i] = letters[next() % letters.size()];
+        }
+        words.push_back(w);
+      }
+    }
+    return words;
+  }
+
+  // n words picked at random from words.
+  vector<string> sample(const vector<string>& words, size_t n)
+  {
+    vector<string> picked;
+    for(size_t i = 0; i < n; i++) {
+      picked.push_back(words[next() % words.size()]);
+    }
+    return picked;
+  }
+};
+
+// Counts what's written to it, and throws it away, so writing out can be
+// timed without timing a disk.
+class counting_buf : public streambuf
+{
+ public:
+  uint64_t bytes, lines;
+
+  counting_buf()
+    : bytes(0), lines(0)
+  {
+  }
+
+ protected:
+  int overflow(int c)
+  {
+    if(c == EOF) {
+      return 0;
+    }
+    bytes++;
+    lines += c == '\n';
+    return c;
+  }
+
+  streamsize xsputn(const char *s, streamsize n)
+  {
+    bytes += n;
+    lines += count(s, s + n, '\n');
+    return n;
+  }
+};
+
+struct bench_result
+{
+  string backend;
+  size_t n_words;
+  double build_s;
+  long peak_rss_kb;
+  double bytes_per_word;
+  double query_ns;   // NaN if the backend can't be queried
+  double write_mb_s; // Likewise if it can't be written out
+  uint64_t groups;
+};
+
+double now_ns()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+// ru_maxrss is in bytes on Darwin, but kilobytes on Linux and the BSDs.
+long peak_rss_kb()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+long current_rss_kb()
+{
+#if defined(__APPLE__)
+  struct task_basic_info info;
+  mach_msg_type_number_t count = TASK_BASIC_INFO_COUNT;
+  if(task_info(mach_task_self(), TASK_BASIC_INFO,
+               reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS) {
+    return peak_rss_kb();
+  }
+  return info.resident_size / 1024;
+#elif defined(__linux__)
+  ifstream statm("/proc/self/statm");
+  long size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+  // No portable way to ask; in a freshly forked child the peak so far is
+  // close enough.
+  return peak_rss_kb();
+#endif
+}
+
+template <class grouping>
+void time_write_out(const grouping& g, bench_result& r)
+{
+  counting_buf buf;
+  ostream out(&buf);
+  const double start = now_ns();
+  out << g;
+  r.write_mb_s = buf.bytes / ((now_ns() - start) / 1e9) / (1 << 20);
+  r.groups = buf.lines;
+}
+
+void bench_anagrams(const vector<string>& words, const vector<string>& queries,
+                    unsigned int n_threads, bench_result& r)
+{
+  anagrams a;
+  double start = now_ns();
+  if(n_threads > 1) {
+    a.insert(words, n_threads);
+  } else {
+    copy(words.begin(), words.end(), back_inserter(a));
+  }
+  a.begin(); // Finish the layout off
+  r.build_s = (now_ns() - start) / 1e9;
+
+  size_t found = 0;
+  start = now_ns();
+  for(vector<string>::const_iterator q = queries.begin(); q != queries.end();
+      q++) {
+    const anagrams::word_list *l = a.find(*q);
+    found += l ? l->size() : 0;
+  }
+  r.query_ns = (now_ns() - start) / queries.size();
+  time_write_out(a, r);
+  if(found == 0) {
+    cerr << r.backend << ": no queries found a group!" << endl;
+  }
+}
+
+void bench_batch_anagrams(const vector<string>& words, bench_result& r)
+{
+  const double start = now_ns();
+  batch_anagrams b(words);
+  r.build_s = (now_ns() - start) / 1e9;
+  time_write_out(b, r);
+}
+
+// Spilling runs of 64MB to disk, so the build time includes writing
+// them and writing out includes merging them.
+void bench_external_anagrams(const vector<string>& words, bench_result& r)
+{
+  external_anagrams e("kata6_bench", 64 << 20, 16);
+  const double start = now_ns();
+  copy(words.begin(), words.end(), back_inserter(e));
+  r.build_s = (now_ns() - start) / 1e9;
+
+  counting_buf buf;
+  ostream out(&buf);
+  const double write_start = now_ns();
+  e.write_out(out);
+  r.write_mb_s = buf.bytes / ((now_ns() - write_start) / 1e9) / (1 << 20);
+  r.groups = buf.lines;
+}
+
+// The build time is the time to write the index from a built anagrams.
+void bench_anagram_index(const vector<string>& words,
+                         const vector<string>& queries, bench_result& r)
+{
+  const string filename = "kata6_bench.idx";
+  {
+    anagrams a;
+    a.insert(words);
+    const double start = now_ns();
+    write_index(a, filename);
+    r.build_s = (now_ns() - start) / 1e9;
+  }
+
+  anagram_index idx(filename);
+  size_t found = 0;
+  const double start = now_ns();
+  for(vector<string>::const_iterator q = queries.begin(); q != queries.end();
+      q++) {
+    found += idx.lookup(*q).size();
+  }
+  r.query_ns = (now_ns() - start) / queries.size();
+  r.groups = idx.size();
+
+  struct stat st;
+  stat(filename.c_str(), &st);
+  r.bytes_per_word = double(st.st_size) / words.size();
+  unlink(filename.c_str());
+  if(found == 0) {
+    cerr << r.backend << ": no queries found a group!" << endl;
+  }
+}
+
+bench_result run_backend(const string& backend, size_t n_words, uint64_t seed)
+{
+  dictionary_generator gen(seed);
+  const vector<string> words = gen(n_words);
+  const vector<string> queries = gen.sample(words, min<size_t>(n_words,
+                                                               100000));
+  bench_result r;
+  r.backend = backend;
+  r.n_words = n_words;
+  r.bytes_per_word = 0;
+  r.query_ns = r.write_mb_s = numeric_limits<double>::quiet_NaN();
+  r.groups = 0;
+
+  const long base_kb = current_rss_kb();
+  if(backend == "anagrams") {
+    bench_anagrams(words, queries, 1, r);
+  } else if(backend == "anagrams(parallel)") {
+    bench_anagrams(words, queries, boost::thread::hardware_concurrency(), r);
+  } else if(backend == "batch_anagrams") {
+    bench_batch_anagrams(words, r);
+  } else if(backend == "external_anagrams") {
+    bench_external_anagrams(words, r);
+  } else {
+    bench_anagram_index(words, queries, r);
+  }
+  r.peak_rss_kb = peak_rss_kb();
+  if(r.bytes_per_word == 0) {
+    r.bytes_per_word = (r.peak_rss_kb - base_kb) * 1024.0 / n_words;
+  }
+  return r;
+}
+
+// Run one backend in a child process, so it has a peak RSS of its own,
+// and return its line of output.
+string run_isolated(const string& backend, size_t n_words, uint64_t seed)
+{
+  int fds[2];
+  if(pipe(fds) != 0) {
+    throw runtime_error("Cannot create a pipe");
+  }
+  const pid_t pid = fork();
+  if(pid < 0) {
+    throw runtime_error("Cannot fork");
+  }
+  if(pid == 0) {
+    close(fds[0]);
+    int status = 0;
+    try {
+      const bench_result r = run_backend(backend, n_words, seed);
+      ostringstream line;
+      line << r.backend << "\t" << r.n_words << "\t" << r.build_s << "\t"
+           << r.build_s * 1e9 / r.n_words << "\t" << r.peak_rss_kb << "\t"
+           << r.bytes_per_word << "\t" << r.query_ns << "\t"
+           << r.write_mb_s << "\t" << r.groups << "\n";
+      const string s = line.str();
+      status = write(fds[1], s.data(), s.size()) == ssize_t(s.size()) ? 0 : 1;
+    } catch(const exception& e) {
+      cerr << backend << ": " << e.what() << endl;
+      status = 1;
+    }
+    _exit(status);
+  }
+
+  close(fds[1]);
+  string line;
+  char buf[256];
+  ssize_t n;
+  while((n = read(fds[0], buf, sizeof buf)) > 0) {
+    line.append(buf, n);
+  }
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  if(line.empty()) {
+    ostringstream failed;
+    failed << backend << "\t" << n_words << "\tfailed\n";
+    return failed.str();
+  }
+  return line;
+}
+
+int main(int argc, char *argv[])
+{
+  const size_t max_words = argc > 1 ? atol(argv[1]) : 1000000;
+  const uint64_t seed = argc > 2 ? strtoull(argv[2], 0, 0) : 1;
+  ofstream out_file;
+  if(argc > 3) {
+    out_file.open(argv[3]);
+  }
+  ostream& out = argc > 3 ? out_file : cout;
+
+  const char *backends[] = { "anagrams", "anagrams(parallel)",
+                             "batch_anagrams", "external_anagrams",
+                             "anagram_index" };
+
+  out << "# max_words=" << max_words << " seed=" << seed << endl;
+  out << "backend\tn_words\tbuild_s\tbuild_ns_per_word\tpeak_rss_kb"
+      << "\tbytes_per_word\tquery_ns\twrite_mb_per_s\tgroups" << endl;
+  for(size_t n_words = 10000; n_words <= max_words; n_words *= 10) {
+    for(size_t b = 0; b < sizeof backends / sizeof *backends; b++) {
+      out << run_isolated(backends[b], n_words, seed) << flush;
+    }
+  }
+  return 0;
+}
+
+#endif // KATA6_BENCHMARK
@@ -38,43 +38,129 @@
 // http://www.pragprog.com/pragdave/Practices/Kata/KataNine.rdoc
 
 #include <boost/test/unit_test.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/bind.hpp>
+#include <boost/utility.hpp>
 
 #include <map>
+#include <vector>
+#include <algorithm>
 #include <string>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
 #include <utility>
-#include <numeric>
+#include <stdexcept>
+#include <limits>
+#include <climits>
+#include <ctime>
+
+extern "C" {
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+};
 
 using boost::unit_test_framework::test_suite;
 using namespace std;
 
-typedef char item;
+// Items are SKUs, any 64-bit code.
+typedef uint64_t item;
 typedef unsigned int price;
 typedef unsigned int quantity;
 
+class compiled_rules;
+
+// Each item has a unit price and any number of multi-buy tiers ("3 for
+// 130", "6 for 250", or "buy 2 get 1 free" as "3 for the price of 2"),
+// and bundles offer a price for a mix of items ("A and B for 70", or "buy
+// an A and get a D free").  A basket costs the cheapest way of splitting
+// it into bundles, tiers and single items.
+//
+// This is the editable, straightforward version, which checks the
+// compiled_rules.
 class checkout_rules
 {
+  friend class compiled_rules;
+
  public:
   typedef pair<quantity, price> rule;
+  typedef map<item, quantity> item_counts;
 
  private:
   struct item_info
   {
     price p;
-    rule r;
+    vector<rule> tiers;
 
     item_info()
-      : p(0), r(1, p)
+      : p(0)
     {
     }
 
     item_info(const price& p, const rule& r)
-      : p(p), r(r)
+      : p(p), tiers(1, r)
     {
     }
   };
   typedef map<item, item_info> rules_list;
   rules_list rules;
 
+  struct bundle
+  {
+    item_counts contents;
+    price p;
+  };
+  vector<bundle> bundles;
+
+  const item_info& find(const item& i) const
+  {
+    rules_list::const_iterator it = rules.find(i);
+    if(it == rules.end()) {
+      throw logic_error("There is no such item!");
+    }
+    return it->second;
+  }
+
+  // Try every number of each bundle in turn.
+  price cheapest(size_t b, item_counts& basket) const
+  {
+    if(b == bundles.size()) {
+      price t = 0;
+      for(item_counts::const_iterator it = basket.begin(); it != basket.end();
+          it++) {
+        t += get_price(it->first, it->second);
+      }
+      return t;
+    }
+
+    price best = cheapest(b + 1, basket);
+    const item_counts& contents = bundles[b].contents;
+    quantity k = 0;
+    for(;;) {
+      item_counts::const_iterator it;
+      for(it = contents.begin(); it != contents.end(); it++) {
+        if(basket[it->first] < it->second) {
+          break;
+        }
+      }
+      if(it != contents.end()) {
+        break;
+      }
+      for(it = contents.begin(); it != contents.end(); it++) {
+        basket[it->first] -= it->second;
+      }
+      k++;
+      best = min(best, k * bundles[b].p + cheapest(b + 1, basket));
+    }
+    for(item_counts::const_iterator it = contents.begin();
+        it != contents.end(); it++) {
+      basket[it->first] += k * it->second;
+    }
+    return best;
+  }
+
  public:
   void add(const item& i, const price& p, const rule& r)
   {
@@ -86,55 +172,948 @@ class checkout_rules
     add(i, p, make_pair(1, p));
   }
 
-  price get_price(const item&i, const quantity& q) const
+  // Another multi-buy tier for an item.  With several tiers, compiling
+  // works out the item's price for every quantity up to the best value
+  // tier's quantity times the largest tier's, plus one more lot; past 2^24
+  // of them (64MB) it gives up and throws.
+  void add_tier(const item& i, const rule& r)
   {
-    rules_list::const_iterator it = rules.find(i);
-    if(it == rules.end()) {
+    find(i);
+    rules[i].tiers.push_back(r);
+  }
+
+  // Buy some of an item and get some more free.
+  void add_buy_get(const item& i, const quantity& buy, const quantity& free)
+  {
+    add_tier(i, make_pair(buy + free, buy * find(i).p));
+  }
+
+  void add_bundle(const item_counts& contents, const price& p)
+  {
+    for(item_counts::const_iterator it = contents.begin();
+        it != contents.end(); it++) {
+      find(it->first);
+      if(it->second == 0) {
+        throw logic_error("A bundle needs at least one of each item!");
+      }
+    }
+    bundle b = { contents, p };
+    bundles.push_back(b);
+  }
+
+  // The cheapest price for q of item i on its own.
+  price get_price(const item& i, const quantity& q) const
+  {
+    const item_info& info = find(i);
+    for(vector<rule>::const_iterator r = info.tiers.begin();
+        r != info.tiers.end(); r++) {
+      if(r->first == 0) {
+        throw logic_error("A multi-buy needs at least one item!");
+      }
+    }
+
+    // With one deal, take as many as possible if it's any good.
+    if(info.tiers.size() == 1) {
+      const rule& r = info.tiers[0];
+      if(uint64_t(r.second) >= uint64_t(info.p) * r.first) {
+        return info.p * q;
+      }
+      return info.p * (q % r.first) + r.second * (q / r.first);
+    }
+
+    vector<price> best(q + 1, 0);
+    for(quantity n = 1; n <= q; n++) {
+      best[n] = best[n - 1] + info.p;
+      for(vector<rule>::const_iterator r = info.tiers.begin();
+          r != info.tiers.end(); r++) {
+        if(r->first <= n) {
+          best[n] = min(best[n], best[n - r->first] + r->second);
+        }
+      }
+    }
+    return best[q];
+  }
+
+  // The cheapest price for a whole basket, bundles and all.
+  price get_price(const item_counts& basket) const
+  {
+    item_counts b(basket);
+    return cheapest(0, b);
+  }
+};
+
+// A checkout_rules frozen into flat arrays for pricing.  The checkout_rules
+// remain the thing to edit; compile them again to pick up any changes.
+//
+// Each SKU is given a dense id, found through an open-addressing hash
+// table of ids which is kept no more than 70% full.  The table holds only
+// the ids, and each item's entry holds its SKU to check against, so
+// finding an item's rules is a load from the table and a load of the
+// entry, however big the catalogue.  Unknown SKUs get the id of one extra
+// entry at the end, which has no rules.
+//
+// An item with at most one worthwhile deal is priced by formula: the
+// deal's quantity has a precomputed reciprocal, so splitting a quantity
+// into deals and leftovers takes a few multiplications instead of a
+// division, and an unknown item's price is masked to nothing rather than
+// branched around.
+//
+// An item with several tiers has the cheapest price of every quantity up
+// to a point worked out in advance.  Past that point the cheapest price
+// always includes the best value tier (in any cheapest price, fewer than
+// n of the pieces can be anything else, where n is that tier's quantity,
+// or some of them would add up to a multiple of n and could be swapped
+// for it), so the prices repeat, going up by that tier's price every n.
+// The table runs to the repeat point plus n, worked out in 64 bits;
+// compiling throws rather than build one of more than max_tier_prices.
+//
+// Bundles are priced by a search over how many of each bundle to use,
+// remembering the best price for what's left once each bundle has been
+// decided.
+class compiled_rules
+{
+  struct entry
+  {
+    item sku;
+    uint64_t reciprocal; // 2^64 / n, rounded up
+    quantity n;          // The deal's quantity, or the best value tier's
+    price unit;
+    price deal;
+    price known;         // All ones if there's a rule for the item
+    quantity base;       // Where prices start repeating
+    uint32_t tiers;      // Index + 1 of its prices in tier_prices, or 0
+    uint32_t bundled;    // Index + 1 in bundle_items, or 0
+  };
+  vector<entry> entries; // By id, then one for unknown items
+  vector<uint32_t> index; // Id + 1, or 0 if the slot is empty
+
+  // The most prices worked out in advance for one item (64MB of them).
+  static const quantity max_tier_prices = 1 << 24;
+  vector<price> tier_prices;
+
+  struct bundle
+  {
+    vector<pair<uint32_t, quantity> > contents; // Index in bundle_items
+    price p;
+  };
+  vector<bundle> bundles;
+  vector<uint32_t> bundle_items; // Ids
+  vector<uint32_t> last_bundle;  // For each of bundle_items
+  typedef map<vector<quantity>, price> price_memo;
+
+  // q / n and q % n, exact for any 32-bit q (Lemire, Kaser and Kurz).
+  static quantity deals(const entry& e, quantity q)
+  {
+    return (static_cast<unsigned __int128>(e.reciprocal) * q) >> 64;
+  }
+  static quantity leftovers(const entry& e, quantity q)
+  {
+    return (static_cast<unsigned __int128>(e.reciprocal * q) * e.n) >> 64;
+  }
+
+  static size_t hash(const item& sku)
+  {
+    uint64_t h = sku;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  // Smallest power of two table which keeps n entries below 70% full.
+  static size_t table_size(size_t n)
+  {
+    size_t size = 16;
+    while((n + 1) * 10 > size * 7) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  // Fill in everything about an item's price.
+  void compile(entry& e, price unit, const vector<checkout_rules::rule>& r)
+  {
+    // A deal on one is just a lower unit price, and a deal which is no
+    // cheaper than buying singly will never be used.
+    vector<checkout_rules::rule> worthwhile;
+    for(vector<checkout_rules::rule>::const_iterator t = r.begin();
+        t != r.end(); t++) {
+      if(t->first == 0) {
+        throw logic_error("A multi-buy needs at least one item!");
+      }
+      if(t->first == 1) {
+        unit = min(unit, t->second);
+      }
+    }
+    for(vector<checkout_rules::rule>::const_iterator t = r.begin();
+        t != r.end(); t++) {
+      if(t->first > 1 && uint64_t(t->second) < uint64_t(unit) * t->first) {
+        worthwhile.push_back(*t);
+      }
+    }
+
+    e.unit = unit;
+    e.known = ~price(0);
+    if(worthwhile.empty()) {
+      // The reciprocal of 1 doesn't fit, so make it a "deal" on the most
+      // there could be, which wraps around to the same price.
+      e.n = numeric_limits<quantity>::max();
+      e.deal = unit * e.n;
+    } else if(worthwhile.size() == 1) {
+      e.n = worthwhile[0].first;
+      e.deal = worthwhile[0].second;
+    } else {
+      quantity largest = 0;
+      e.n = 1;
+      e.deal = unit;
+      for(vector<checkout_rules::rule>::const_iterator t = worthwhile.begin();
+          t != worthwhile.end(); t++) {
+        largest = max(largest, t->first);
+        if(uint64_t(t->second) * e.n < uint64_t(e.deal) * t->first) {
+          e.n = t->first;
+          e.deal = t->second;
+        }
+      }
+      const uint64_t base = uint64_t(e.n) * largest;
+      if(base + e.n > max_tier_prices
+         || tier_prices.size() + base + e.n
+            > numeric_limits<uint32_t>::max()) {
+        throw logic_error("Those multi-buys are too big to compile!");
+      }
+      e.base = base;
+      e.tiers = tier_prices.size() + 1;
+      tier_prices.push_back(0);
+      for(quantity q = 1; q < e.base + e.n; q++) {
+        price best = tier_prices.back() + unit;
+        for(vector<checkout_rules::rule>::const_iterator t
+              = worthwhile.begin(); t != worthwhile.end(); t++) {
+          if(t->first <= q) {
+            best = min(best, tier_prices[e.tiers - 1 + q - t->first]
+                       + t->second);
+          }
+        }
+        tier_prices.push_back(best);
+      }
+    }
+    e.reciprocal = numeric_limits<uint64_t>::max() / e.n + 1;
+  }
+
+  // The cheapest price for the bundled items still in counts using
+  // bundles b onwards.  Once the last bundle an item is in has been
+  // decided, the item is priced on its own and dropped from counts, so
+  // there's less to tell apart when remembering prices.
+  price cheapest(size_t b, vector<quantity>& counts, price_memo& memo) const
+  {
+    if(b == bundles.size()) {
+      return 0;
+    }
+
+    counts.push_back(b);
+    price_memo::const_iterator m = memo.find(counts);
+    counts.pop_back();
+    if(m != memo.end()) {
+      return m->second;
+    }
+
+    const vector<pair<uint32_t, quantity> >& contents = bundles[b].contents;
+    price best = numeric_limits<price>::max();
+    vector<quantity> rest;
+    quantity k = 0;
+    for(;;) {
+      price t = k * bundles[b].p;
+      rest = counts;
+      for(size_t j = 0; j < rest.size(); j++) {
+        if(last_bundle[j] == b) {
+          t += line_price(bundle_items[j], rest[j]);
+          rest[j] = 0;
+        }
+      }
+      best = min(best, t + cheapest(b + 1, rest, memo));
+
+      size_t j;
+      for(j = 0; j < contents.size(); j++) {
+        if(counts[contents[j].first] < contents[j].second) {
+          break;
+        }
+      }
+      if(j != contents.size()) {
+        break;
+      }
+      for(j = 0; j < contents.size(); j++) {
+        counts[contents[j].first] -= contents[j].second;
+      }
+      k++;
+    }
+    for(size_t j = 0; j < contents.size(); j++) {
+      counts[contents[j].first] += k * contents[j].second;
+    }
+
+    counts.push_back(b);
+    memo[counts] = best;
+    counts.pop_back();
+    return best;
+  }
+
+ public:
+  typedef uint32_t item_id;
+
+  compiled_rules(const checkout_rules& r)
+  {
+    const entry none = { 0, 0, numeric_limits<quantity>::max(), 0, 0, 0, 0,
+                         0, 0 };
+    entries.reserve(r.rules.size() + 1);
+    index.assign(table_size(r.rules.size()), 0);
+    for(checkout_rules::rules_list::const_iterator it = r.rules.begin();
+        it != r.rules.end(); it++) {
+      entry e = none;
+      e.sku = it->first;
+      compile(e, it->second.p, it->second.tiers);
+      entries.push_back(e);
+
+      const size_t mask = index.size() - 1;
+      size_t i = hash(e.sku) & mask;
+      while(index[i] != 0) {
+        i = (i + 1) & mask;
+      }
+      index[i] = entries.size();
+    }
+    entries.push_back(none);
+
+    for(vector<checkout_rules::bundle>::const_iterator b = r.bundles.begin();
+        b != r.bundles.end(); b++) {
+      bundle c;
+      c.p = b->p;
+      for(checkout_rules::item_counts::const_iterator it
+            = b->contents.begin(); it != b->contents.end(); it++) {
+        entry& e = entries[id(it->first)];
+        if(e.bundled == 0) {
+          bundle_items.push_back(id(it->first));
+          last_bundle.push_back(0);
+          e.bundled = bundle_items.size();
+        }
+        last_bundle[e.bundled - 1] = bundles.size();
+        c.contents.push_back(make_pair(e.bundled - 1, it->second));
+      }
+      bundles.push_back(c);
+    }
+  }
+
+  // The number of items, which is also the id of any unknown item.
+  size_t size() const
+  {
+    return entries.size() - 1;
+  }
+
+  item_id id(const item& sku) const
+  {
+    const size_t mask = index.size() - 1;
+    for(size_t i = hash(sku) & mask; index[i] != 0; i = (i + 1) & mask) {
+      if(entries[index[i] - 1].sku == sku) {
+        return index[i] - 1;
+      }
+    }
+    return size();
+  }
+
+  bool known(item_id i) const
+  {
+    return entries[i].known != 0;
+  }
+
+  // The price of one, without any deals.
+  price unit_price(item_id i) const
+  {
+    return entries[i].unit;
+  }
+
+  // Where the item is among the items in bundles, plus one, or 0 if it
+  // isn't in any bundle and so can be priced on its own.
+  uint32_t bundle_slot(item_id i) const
+  {
+    return entries[i].bundled;
+  }
+
+  size_t n_bundled() const
+  {
+    return bundle_items.size();
+  }
+
+  // The cheapest price of q of item i on its own, or nothing if there's
+  // no such item.
+  price line_price(item_id i, quantity q) const
+  {
+    const entry& e = entries[i];
+    if(e.tiers == 0) {
+      return (e.unit * leftovers(e, q) + e.deal * deals(e, q)) & e.known;
+    }
+    const quantity over = q > e.base ? q - e.base : 0;
+    return e.deal * deals(e, over)
+      + tier_prices[e.tiers - 1 + q - over + leftovers(e, over)];
+  }
+
+  // The cheapest price for the bundled items, given how many there are
+  // of each, in bundle slot order.
+  price bundle_price(vector<quantity> counts) const
+  {
+    if(bundles.empty()) {
+      return 0;
+    }
+    price_memo memo;
+    return cheapest(0, counts, memo);
+  }
+
+  bool has(const item& sku) const
+  {
+    return known(id(sku));
+  }
+
+  price price_of(const item& sku, const quantity& q) const
+  {
+    return line_price(id(sku), q);
+  }
+
+  price get_price(const item& sku, const quantity& q) const
+  {
+    if(!has(sku)) {
       throw logic_error("There is no such item!");
     }
-    return it->second.p * (q % it->second.r.first)
-      + (it->second.r.second * (q / it->second.r.first));
+    return price_of(sku, q);
+  }
+
+  // Bytes used, all told.
+  size_t memory_used() const
+  {
+    size_t bytes = sizeof *this + entries.capacity() * sizeof(entry)
+      + index.capacity() * sizeof(uint32_t)
+      + tier_prices.capacity() * sizeof(price)
+      + bundles.capacity() * sizeof(bundle)
+      + bundle_items.capacity() * sizeof(uint32_t)
+      + last_bundle.capacity() * sizeof(uint32_t);
+    for(vector<bundle>::const_iterator b = bundles.begin(); b != bundles.end();
+        b++) {
+      bytes += b->contents.capacity() * sizeof(pair<uint32_t, quantity>);
+    }
+    return bytes;
   }
 };
 
-class checkout
+// The rules shared by every checkout, which can be changed while they're
+// scanning.  Each version of the rules is compiled once and never changed,
+// and is kept for as long as any checkout holds a ref to it.  publish()
+// swaps in a new version atomically; scanners never take a lock.  Taking
+// a ref to the latest version is guarded by two epoch-indexed reader
+// counts in the style of userspace RCU, as for kata5's filter_snapshot, so
+// that the publisher knows when nobody can still be about to take a ref
+// to the old version and it can let go of its own.
+class rule_set : boost::noncopyable
 {
-  typedef map<item, quantity> item_list;
-  item_list items;
-  checkout_rules rules;
+  struct version : boost::noncopyable
+  {
+    const compiled_rules rules;
+    unsigned long number;
+    unsigned long refs;
+
+    version(const checkout_rules& r, unsigned long number)
+      : rules(r), number(number), refs(1)
+    {
+    }
+  };
+
+  version *current;
+  unsigned long latest;
+  mutable unsigned long epoch;
+  mutable unsigned long readers[2];
+  boost::mutex publishing;
+
+  void wait_for_readers()
+  {
+    const unsigned long e = __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&readers[e & 1], __ATOMIC_SEQ_CST) != 0) {
+      boost::thread::yield();
+    }
+  }
 
-  // Binary function to aid accumulate() in figuring out the total price.
-  class figure_out_price
-    : public binary_function<price, pair<const item, quantity>, price>
+ public:
+  // A counted reference to one version of the rules.
+  class ref
   {
-    const checkout_rules& rules;
+    friend class rule_set;
+    version *v;
+
+    // Takes over a reference already counted.
+    explicit ref(version *v)
+      : v(v)
+    {
+    }
+
   public:
-    figure_out_price(const checkout_rules& rules) : rules(rules)
+    // A version of its own, for rules which aren't shared.
+    explicit ref(const checkout_rules& r)
+      : v(new version(r, 0))
+    {
+    }
+
+    ref(const ref& r)
+      : v(r.v)
+    {
+      __atomic_fetch_add(&v->refs, 1, __ATOMIC_SEQ_CST);
+    }
+
+    ~ref()
+    {
+      if(__atomic_sub_fetch(&v->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+        delete v;
+      }
+    }
+
+    ref& operator=(const ref& r)
+    {
+      ref copy(r);
+      swap(v, copy.v);
+      return *this;
+    }
+
+    const compiled_rules& operator*() const
     {
+      return v->rules;
     }
-    figure_out_price::result_type
-    operator()(const figure_out_price::first_argument_type& result,
-               const figure_out_price::second_argument_type& rule)
+
+    const compiled_rules* operator->() const
     {
-      return result + rules.get_price(rule.first, rule.second);
+      return &v->rules;
     }
+
+    unsigned long number() const
+    {
+      return v->number;
+    }
+  };
+
+  // Must outlive any checkout following the latest rules.  Versions still
+  // held by pinned checkouts outlive the rule_set itself.
+  rule_set(const checkout_rules& initial)
+    : current(new version(initial, 1)), latest(1), epoch(0)
+  {
+    readers[0] = readers[1] = 0;
+  }
+
+  ~rule_set()
+  {
+    ref release(current);
+  }
+
+  // The number of the latest version, without taking a ref to it.
+  unsigned long latest_number() const
+  {
+    return __atomic_load_n(&latest, __ATOMIC_SEQ_CST);
+  }
+
+  ref get() const
+  {
+    const unsigned long parity = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&readers[parity], 1, __ATOMIC_SEQ_CST);
+    version *v = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&v->refs, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_sub(&readers[parity], 1, __ATOMIC_SEQ_CST);
+    return ref(v);
+  }
+
+  // Compile r and make it the latest version, returning its number.
+  // Checkouts holding an older version keep it until they let go of it.
+  // Publishers are serialised, but never block scanners.
+  unsigned long publish(const checkout_rules& r)
+  {
+    version *next = new version(r, 0);
+    boost::mutex::scoped_lock lock(publishing);
+    next->number = current->number + 1;
+    version *old = __atomic_exchange_n(&current, next, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&latest, next->number, __ATOMIC_SEQ_CST);
+    wait_for_readers();
+    wait_for_readers();
+    ref release(old);
+    return next->number;
+  }
+};
+
+// Keeps a running total as items are scanned, adding (or, for a voided
+// item, taking away) just the difference that item makes to the price of
+// its line, so total() costs nothing however long the basket gets.  Items
+// in bundles can't be priced line by line, so the bundled part of the
+// basket is priced again whenever one of them is scanned.
+//
+// The lines are a flat array, found by item id through a small hash
+// table, so a checkout only takes room for what's been scanned however
+// big the catalogue is.  The rules are shared through a rule_set, and a
+// checkout either keeps the version it started with or moves to the
+// latest one as it's published, the next time an item is scanned.  A
+// pinned checkout holds its own ref and can outlive the rule_set, but one
+// following the latest rules keeps asking the rule_set for them, so the
+// rule_set must outlive it.
+class checkout
+{
+ public:
+  enum updates { pinned, follow_latest };
+
+ private:
+  typedef compiled_rules::item_id item_id;
+
+  struct line
+  {
+    item sku;
+    item_id id;
+    quantity q;
   };
 
+  const rule_set *shared; // To follow for updates, or 0
+  rule_set::ref rules;
+  vector<line> lines;
+  vector<uint32_t> line_index; // Line + 1, or 0 if the slot is empty
+  vector<quantity> bundle_counts;
+  price loose_total;   // Items which aren't in any bundle
+  price bundle_total;  // The rest
+
+  void index_lines(size_t size)
+  {
+    line_index.assign(size, 0);
+    const size_t mask = line_index.size() - 1;
+    for(size_t l = 0; l < lines.size(); l++) {
+      size_t i = (lines[l].id * 2654435761U) & mask;
+      while(line_index[i] != 0) {
+        i = (i + 1) & mask;
+      }
+      line_index[i] = l + 1;
+    }
+  }
+
+  // The line for item id, or 0 if it hasn't been scanned.
+  line* find_line(item_id id)
+  {
+    if(line_index.empty()) {
+      return 0;
+    }
+    const size_t mask = line_index.size() - 1;
+    for(size_t i = (id * 2654435761U) & mask; line_index[i] != 0;
+        i = (i + 1) & mask) {
+      if(lines[line_index[i] - 1].id == id) {
+        return &lines[line_index[i] - 1];
+      }
+    }
+    return 0;
+  }
+
+  quantity& count(item_id id, const item& sku)
+  {
+    if((lines.size() + 1) * 10 > line_index.size() * 7) {
+      index_lines(line_index.empty() ? 16 : line_index.size() * 2);
+    }
+
+    const size_t mask = line_index.size() - 1;
+    size_t i = (id * 2654435761U) & mask;
+    for(; line_index[i] != 0; i = (i + 1) & mask) {
+      if(lines[line_index[i] - 1].id == id) {
+        return lines[line_index[i] - 1].q;
+      }
+    }
+    const line l = { sku, id, 0 };
+    lines.push_back(l);
+    line_index[i] = lines.size();
+    return lines.back().q;
+  }
+
+  // The count of item id has just changed from was to now.
+  void reprice(item_id id, quantity was, quantity now)
+  {
+    const uint32_t slot = rules->bundle_slot(id);
+    if(slot != 0) {
+      bundle_counts[slot - 1] = now;
+      bundle_total = rules->bundle_price(bundle_counts);
+    } else {
+      loose_total += rules->line_price(id, now) - rules->line_price(id, was);
+    }
+  }
+
  public:
+  // Rules of its own, not shared with any other checkout.
   checkout(const checkout_rules& r)
-    : rules(r)
+    : shared(0), rules(r), bundle_counts(rules->n_bundled(), 0),
+      loose_total(0), bundle_total(0)
+  {
+  }
+
+  // With follow_latest, s must outlive the checkout.
+  checkout(const rule_set& s, updates u = pinned)
+    : shared(u == follow_latest ? &s : 0), rules(s.get()),
+      bundle_counts(rules->n_bundled(), 0), loose_total(0), bundle_total(0)
+  {
+  }
+
+  // The version of the rules the total is priced with.
+  unsigned long version() const
   {
+    return rules.number();
+  }
+
+  // Move to the latest rules, if following them, and price everything
+  // scanned so far again.  Any items which the new rules no longer have
+  // are left out of the total.
+  void refresh()
+  {
+    if(shared == 0 || shared->latest_number() == rules.number()) {
+      return;
+    }
+    rules = shared->get();
+    loose_total = 0;
+    bundle_counts.assign(rules->n_bundled(), 0);
+    for(vector<line>::iterator l = lines.begin(); l != lines.end(); l++) {
+      l->id = rules->id(l->sku);
+      const uint32_t slot = rules->bundle_slot(l->id);
+      if(slot != 0) {
+        bundle_counts[slot - 1] = l->q;
+      } else {
+        loose_total += rules->line_price(l->id, l->q);
+      }
+    }
+    bundle_total = rules->bundle_price(bundle_counts);
+    if(!lines.empty()) {
+      index_lines(line_index.size());
+    }
   }
 
   unsigned int total() const
   {
-    return accumulate(items.begin(), items.end(), 0U,
-                      figure_out_price(rules));
+    return loose_total + bundle_total;
+  }
+
+  // The number of different items scanned, including any since voided.
+  size_t size() const
+  {
+    return lines.size();
+  }
+
+  // The total worked out from scratch, which total() should always match.
+  unsigned int recompute() const
+  {
+    price t = rules->bundle_price(bundle_counts);
+    for(vector<line>::const_iterator l = lines.begin(); l != lines.end();
+        l++) {
+      if(rules->bundle_slot(l->id) == 0) {
+        t += rules->line_price(l->id, l->q);
+      }
+    }
+    return t;
   }
 
   void scan(const item i)
   {
-    items[i]++;
+    refresh();
+    const item_id id = rules->id(i);
+    if(!rules->known(id)) {
+      throw logic_error("There is no such item!");
+    }
+    const quantity q = ++count(id, i);
+    reprice(id, q - 1, q);
+  }
+
+  // Void one of an item which has been scanned.
+  void unscan(const item i)
+  {
+    refresh();
+    const item_id id = rules->id(i);
+    line *l = rules->known(id) ? find_line(id) : 0;
+    if(l == 0 || l->q == 0) {
+      throw logic_error("That item hasn't been scanned!");
+    }
+    const quantity q = --l->q;
+    reprice(id, q + 1, q);
+  }
+};
+
+// Totals from pricing a lot of carts.  What the items in them would have
+// cost at their unit prices, less what they did cost, is the discount
+// given on each item (by id); items which were priced in bundles share one
+// discount between them.
+struct cart_totals
+{
+  uint64_t carts;
+  uint64_t items;
+  uint64_t rejected;       // Carts with an unknown item, which aren't priced
+  uint64_t revenue;
+  uint64_t bundle_discount;
+  vector<uint64_t> discount;
+
+  cart_totals(size_t n_items)
+    : carts(0), items(0), rejected(0), revenue(0), bundle_discount(0),
+      discount(n_items, 0)
+  {
+  }
+
+  cart_totals& operator+=(const cart_totals& t)
+  {
+    carts += t.carts;
+    items += t.items;
+    rejected += t.rejected;
+    revenue += t.revenue;
+    bundle_discount += t.bundle_discount;
+    for(size_t i = 0; i < discount.size(); i++) {
+      discount[i] += t.discount[i];
+    }
+    return *this;
+  }
+};
+
+// Prices carts in bulk, such as a log of past transactions to see what
+// they'd have cost under different rules.  Each line of the file is a
+// cart, the SKUs of its items separated by spaces.  The file is split into
+// chunks, which a pool of threads take in turn so that they all finish
+// together, and each thread keeps its own totals until they're added up
+// at the end.  Each cart's items are counted into a flat histogram by id,
+// which is cleared again by going back over the items it touched.
+class bulk_pricer
+{
+  typedef compiled_rules::item_id item_id;
+
+  const compiled_rules& rules;
+  const streamoff chunk_size;
+
+  struct histogram
+  {
+    vector<quantity> counts;
+    vector<item_id> touched;
+    vector<quantity> bundle_counts;
+
+    histogram(const compiled_rules& rules)
+      : counts(rules.size() + 1, 0), bundle_counts(rules.n_bundled(), 0)
+    {
+    }
+  };
+
+  void price_cart(const string& cart, histogram& h, cart_totals& t) const
+  {
+    bool known = true, bundled = false;
+    uint64_t n_items = 0;
+    const char *p = cart.c_str();
+    for(;;) {
+      char *end;
+      const item sku = strtoull(p, &end, 10);
+      if(end == p) {
+        // Anything left had better be space.
+        known &= strspn(p, " \t\r") == strlen(p);
+        break;
+      }
+      p = end;
+      const item_id id = rules.id(sku);
+      if(h.counts[id]++ == 0) {
+        h.touched.push_back(id);
+        known &= rules.known(id);
+        bundled |= rules.bundle_slot(id) != 0;
+      }
+      n_items++;
+    }
+
+    if(!known) {
+      t.rejected++;
+    } else if(n_items != 0) {
+      t.carts++;
+      t.items += n_items;
+      price bundle_list = 0;
+      for(vector<item_id>::const_iterator i = h.touched.begin();
+          i != h.touched.end(); i++) {
+        const price list = rules.unit_price(*i) * h.counts[*i];
+        const uint32_t slot = rules.bundle_slot(*i);
+        if(slot != 0) {
+          h.bundle_counts[slot - 1] = h.counts[*i];
+          bundle_list += list;
+        } else {
+          const price p = rules.line_price(*i, h.counts[*i]);
+          t.revenue += p;
+          t.discount[*i] += list - p;
+        }
+      }
+      if(bundled) {
+        const price bundle_total = rules.bundle_price(h.bundle_counts);
+        t.revenue += bundle_total;
+        t.bundle_discount += bundle_list - bundle_total;
+        fill(h.bundle_counts.begin(), h.bundle_counts.end(), 0);
+      }
+    }
+
+    for(vector<item_id>::const_iterator i = h.touched.begin();
+        i != h.touched.end(); i++) {
+      h.counts[*i] = 0;
+    }
+    h.touched.clear();
+  }
+
+  // Keep taking the next chunk until there are none left, pricing every
+  // cart which starts within it.  A cart straddling the start of a chunk
+  // belongs to the previous one.
+  void worker(const string& filename, streamoff size, size_t *next_chunk,
+              cart_totals *t) const
+  {
+    ifstream f(filename.c_str(), ios::binary);
+    histogram h(rules);
+    // Counted locally and copied out at the end, as the threads' totals
+    // sit side by side and would share cache lines.
+    cart_totals local(t->discount.size());
+    string line;
+    for(;;) {
+      const streamoff begin = __sync_fetch_and_add(next_chunk, 1) * chunk_size;
+      if(begin >= size) {
+        *t = local;
+        return;
+      }
+      const streamoff end = min(begin + chunk_size, size);
+
+      f.clear();
+      streamoff pos = begin;
+      if(begin != 0) {
+        f.seekg(begin - 1);
+        getline(f, line);
+        pos += line.size();
+      } else {
+        f.seekg(0);
+      }
+      while(pos < end && getline(f, line)) {
+        pos += line.size() + 1;
+        price_cart(line, h, local);
+      }
+    }
+  }
+
+ public:
+  bulk_pricer(const compiled_rules& rules, streamoff chunk_size = 1 << 22)
+    : rules(rules), chunk_size(chunk_size)
+  {
+  }
+
+  cart_totals price_file(const string& filename,
+                         unsigned int n_threads = boost::thread::hardware_concurrency()) const
+  {
+    ifstream f(filename.c_str(), ios::binary);
+    if(!f) {
+      throw runtime_error("Cannot open carts " + filename);
+    }
+    f.seekg(0, ios::end);
+    const streamoff size = f.tellg();
+    if(n_threads == 0) {
+      n_threads = 1;
+    }
+
+    vector<cart_totals> totals(n_threads, cart_totals(rules.size() + 1));
+    size_t next_chunk = 0;
+    boost::thread_group pool;
+    for(unsigned int i = 0; i < n_threads; i++) {
+      pool.create_thread(boost::bind(&bulk_pricer::worker, this,
+                                     filename, size, &next_chunk,
+                                     &totals[i]));
+    }
+    pool.join_all();
+
+    cart_totals sum(rules.size() + 1);
+    for(unsigned int i = 0; i < n_threads; i++) {
+      sum += totals[i];
+    }
+    return sum;
   }
 };
 
@@ -177,6 +1156,211 @@ void test_totals()
   BOOST_CHECK_EQUAL(190U, price_cart(string("DABABA"), r));
 }
 
+void test_compiled_rules()
+{
+  checkout_rules r(construct_test_rules());
+  r.add('E', 7, make_pair(7, 40));
+  r.add('F', 1000, make_pair(1000000, 1));
+  r.add('G', 5, make_pair(1, 4));
+  const compiled_rules c(r);
+
+  const string items("ABCDEFG");
+  for(string::const_iterator i = items.begin(); i != items.end(); i++) {
+    for(quantity q = 0; q < 2000; q++) {
+      BOOST_CHECK_EQUAL(c.get_price(*i, q), r.get_price(*i, q));
+    }
+    // Quantities too big for the division to be done some other way by
+    // accident.
+    const quantity big[] = { 999999, 1000000, 1000001, 0x7fffffff,
+                             0xfffffffe, 0xffffffff };
+    for(size_t j = 0; j < sizeof big / sizeof *big; j++) {
+      BOOST_CHECK_EQUAL(c.get_price(*i, big[j]), r.get_price(*i, big[j]));
+    }
+  }
+
+  BOOST_CHECK(c.has('A'));
+  BOOST_CHECK(!c.has('Z'));
+  BOOST_CHECK_EQUAL(c.price_of('Z', 3), 0U);
+  BOOST_CHECK_THROW(c.get_price('Z', 1), logic_error);
+
+  checkout_rules bad;
+  bad.add('A', 50, make_pair(0, 0));
+  BOOST_CHECK_THROW(compiled_rules b(bad), logic_error);
+}
+
+checkout_rules::item_counts count_items(const string& items)
+{
+  checkout_rules::item_counts c;
+  for(string::const_iterator i = items.begin(); i != items.end(); i++) {
+    c[*i]++;
+  }
+  return c;
+}
+
+void test_promotions()
+{
+  checkout_rules r(construct_test_rules());
+  r.add_tier('A', make_pair(6, 250));
+  r.add_buy_get('C', 2, 1);
+  r.add('E', 10, make_pair(4, 36));
+  r.add_tier('E', make_pair(7, 60));
+  r.add_tier('E', make_pair(1, 9));
+
+  BOOST_CHECK_EQUAL(r.get_price('A', 6), 250U);
+  BOOST_CHECK_EQUAL(r.get_price('A', 7), 300U);
+  BOOST_CHECK_EQUAL(r.get_price('A', 9), 380U);
+  BOOST_CHECK_EQUAL(r.get_price('A', 12), 500U);
+  BOOST_CHECK_EQUAL(r.get_price('C', 3), 40U);
+  BOOST_CHECK_EQUAL(r.get_price('C', 4), 60U);
+  BOOST_CHECK_EQUAL(r.get_price('E', 8), 69U); // 7 for 60 and one at 9
+  BOOST_CHECK_EQUAL(r.get_price('E', 11), 96U);
+
+  // Every quantity, well past where the prices start repeating.
+  const compiled_rules c(r);
+  const string items("ABCDE");
+  for(string::const_iterator i = items.begin(); i != items.end(); i++) {
+    for(quantity q = 0; q < 500; q++) {
+      BOOST_CHECK_EQUAL(c.get_price(*i, q), r.get_price(*i, q));
+    }
+  }
+  BOOST_CHECK_EQUAL(c.get_price('A', 1000000), 1000000 / 6 * 250U + 180U);
+
+  // Big tiers are still priced right, as long as they tabulate...
+  checkout_rules huge;
+  huge.add('H', 10, make_pair(300, 2500));
+  huge.add_tier('H', make_pair(250, 2200));
+  const compiled_rules cb(huge);
+  for(quantity q = 0; q < 200000; q += 997) {
+    BOOST_CHECK_EQUAL(cb.get_price('H', q), huge.get_price('H', q));
+  }
+  BOOST_CHECK_EQUAL(cb.get_price('H', 1000000), huge.get_price('H', 1000000));
+  checkout co_huge(huge);
+  co_huge.scan('H');
+  BOOST_CHECK_EQUAL(co_huge.total(), 10U);
+
+  // ...but not if the prices only repeat from past 2^32.
+  checkout_rules too_huge;
+  too_huge.add('H', 10, make_pair(65536, 600000));
+  too_huge.add_tier('H', make_pair(65537, 650000));
+  BOOST_CHECK_THROW(compiled_rules c(too_huge), logic_error);
+
+  // A deal that's no deal is never used.
+  checkout_rules dear;
+  dear.add('A', 50, make_pair(2, 120));
+  BOOST_CHECK_EQUAL(dear.get_price('A', 4), 200U);
+  BOOST_CHECK_EQUAL(compiled_rules(dear).get_price('A', 4), 200U);
+
+  // Bundles: A and B for 70, and an A gets a D free.
+  r.add_bundle(count_items("AB"), 70);
+  r.add_bundle(count_items("AD"), 50);
+  BOOST_CHECK_EQUAL(r.get_price(count_items("AB")), 70U);
+  BOOST_CHECK_EQUAL(r.get_price(count_items("AAB")), 120U);
+  BOOST_CHECK_EQUAL(r.get_price(count_items("AAAB")), 160U);
+  BOOST_CHECK_EQUAL(r.get_price(count_items("ABD")), 80U);
+  BOOST_CHECK_EQUAL(r.get_price(count_items("AABDC")), 140U);
+  BOOST_CHECK_THROW(r.add_bundle(count_items("AZ"), 10), logic_error);
+  BOOST_CHECK(compiled_rules(r).memory_used() > c.memory_used());
+
+  // The checkout must find the same prices as the brute force search,
+  // however the basket is built up.
+  const string scans("ABDAACBDAEBADBAAEEBD");
+  checkout co(r);
+  string so_far;
+  for(string::const_iterator i = scans.begin(); i != scans.end(); i++) {
+    co.scan(*i);
+    so_far += *i;
+    BOOST_CHECK_EQUAL(co.total(), r.get_price(count_items(so_far)));
+    BOOST_CHECK_EQUAL(co.total(), co.recompute());
+  }
+  for(string::const_iterator i = scans.begin(); i != scans.end(); i++) {
+    co.unscan(*i);
+    so_far.erase(0, 1);
+    BOOST_CHECK_EQUAL(co.total(), r.get_price(count_items(so_far)));
+  }
+  BOOST_CHECK_EQUAL(co.total(), 0U);
+
+  // Big baskets must be quick to price again on every scan.
+  r.add_bundle(count_items("BCD"), 55);
+  r.add_bundle(count_items("AAE"), 105);
+  checkout big(r);
+  const clock_t start = clock();
+  for(unsigned int n = 0; n < 200; n++) {
+    big.scan(items[n % items.size()]);
+  }
+  const double ms = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+  BOOST_CHECK_EQUAL(big.total(), big.recompute());
+  BOOST_MESSAGE("200 items scanned, with four bundles, in " << ms << "ms.");
+}
+
+void test_bulk_pricing()
+{
+  checkout_rules r(construct_test_rules());
+  r.add_tier('A', make_pair(6, 250));
+  r.add_bundle(count_items("BC"), 40);
+  const compiled_rules c(r);
+
+  // Carts of up to 30 items, and one with an item there's no rule for,
+  // each item written as its SKU.
+  const string filename = "kata9.carts";
+  const string items("ABCD");
+  vector<string> carts;
+  unsigned int seed = 1;
+  {
+    ofstream f(filename.c_str());
+    for(unsigned int n = 0; n < 20000; n++) {
+      seed = seed * 1103515245 + 12345;
+      string cart((seed >> 16) % 31, 'A');
+      for(string::iterator i = cart.begin(); i != cart.end(); i++) {
+        seed = seed * 1103515245 + 12345;
+        *i = items[(seed >> 16) % items.size()];
+      }
+      for(string::const_iterator i = cart.begin(); i != cart.end(); i++) {
+        f << (i == cart.begin() ? "" : " ") << static_cast<item>(*i);
+      }
+      f << endl;
+      if(!cart.empty()) {
+        carts.push_back(cart);
+      }
+    }
+    f << "65 66 90" << endl;
+  }
+
+  cart_totals expected(c.size() + 1);
+  for(vector<string>::const_iterator i = carts.begin(); i != carts.end(); i++) {
+    expected.carts++;
+    expected.items += i->size();
+    expected.revenue += price_cart(*i, r);
+    const checkout_rules::item_counts counts = count_items(*i);
+    if(counts.count('A')) {
+      expected.discount[c.id('A')] += 50 * counts.find('A')->second
+        - r.get_price('A', counts.find('A')->second);
+    }
+  }
+
+  // Small chunks, so plenty of carts straddle them.
+  const bulk_pricer bulk(c, 4096);
+  for(unsigned int n_threads = 1; n_threads <= 4; n_threads++) {
+    struct timeval start, end;
+    gettimeofday(&start, 0);
+    const cart_totals t = bulk.price_file(filename, n_threads);
+    gettimeofday(&end, 0);
+    const double ms = (end.tv_sec - start.tv_sec) * 1000.0
+      + (end.tv_usec - start.tv_usec) / 1000.0;
+    BOOST_CHECK_EQUAL(t.carts, expected.carts);
+    BOOST_CHECK_EQUAL(t.items, expected.items);
+    BOOST_CHECK_EQUAL(t.rejected, 1U);
+    BOOST_CHECK_EQUAL(t.revenue, expected.revenue);
+    BOOST_CHECK_EQUAL(t.discount[c.id('A')], expected.discount[c.id('A')]);
+    BOOST_CHECK_EQUAL(t.discount[c.id('C')], 0U);
+    BOOST_CHECK_EQUAL(t.discount[c.id('D')], 0U);
+    BOOST_MESSAGE(t.carts << " carts priced on " << n_threads
+                  << " threads in " << ms << "ms.");
+  }
+
+  unlink(filename.c_str());
+  BOOST_CHECK_THROW(bulk.price_file(filename), runtime_error);
+}
+
 void test_incremental()
 {
   checkout_rules r(construct_test_rules());
@@ -187,12 +1371,217 @@ void test_incremental()
   co.scan('A'); BOOST_CHECK_EQUAL(130U, co.total());
   co.scan('A'); BOOST_CHECK_EQUAL(160U, co.total());
   co.scan('B'); BOOST_CHECK_EQUAL(175U, co.total());
+
+  // Voiding takes off what the item added, deals and all.
+  co.unscan('A'); BOOST_CHECK_EQUAL(145U, co.total());
+  co.unscan('B'); BOOST_CHECK_EQUAL(130U, co.total());
+  co.unscan('B'); BOOST_CHECK_EQUAL(100U, co.total());
+  co.unscan('A'); BOOST_CHECK_EQUAL( 50U, co.total());
+  co.unscan('A'); BOOST_CHECK_EQUAL(  0U, co.total());
+  BOOST_CHECK_THROW(co.unscan('A'), logic_error);
+  BOOST_CHECK_EQUAL(co.size(), 2U);
+  // Voiding something never scanned leaves the checkout as it was.
+  BOOST_CHECK_THROW(co.unscan('C'), logic_error);
+  BOOST_CHECK_EQUAL(co.size(), 2U);
+  checkout empty(r);
+  BOOST_CHECK_THROW(empty.unscan('D'), logic_error);
+  BOOST_CHECK_EQUAL(empty.size(), 0U);
+  BOOST_CHECK_EQUAL(empty.total(), 0U);
+  BOOST_CHECK_THROW(co.scan('Z'), logic_error);
+  BOOST_CHECK_EQUAL(0U, co.total());
+
+  // A long run of scans and voids must always agree with working the
+  // total out from scratch.
+  const string items("ABCD");
+  unsigned int seed = 1;
+  for(unsigned int n = 0; n < 10000; n++) {
+    seed = seed * 1103515245 + 12345;
+    const item i = items[(seed >> 16) % items.size()];
+    try {
+      if((seed >> 8) % 3 == 0) {
+        co.unscan(i);
+      } else {
+        co.scan(i);
+      }
+    } catch(const logic_error&) {
+      // Voided something which wasn't there.
+    }
+    BOOST_CHECK_EQUAL(co.total(), co.recompute());
+  }
+}
+
+void test_large_catalogue()
+{
+  // A catalogue of random SKUs, some with deals.
+  const unsigned int n_items = 200000;
+  checkout_rules r;
+  vector<item> skus;
+  uint64_t seed = 1;
+  for(unsigned int n = 0; n < n_items; n++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    const item sku = seed ^ (seed >> 29);
+    const price p = 1 + (seed >> 40) % 1000;
+    if(n % 4 == 0) {
+      r.add(sku, p, make_pair(2 + n % 5, p * (2 + n % 5) * 3 / 4));
+    } else {
+      r.add(sku, p);
+    }
+    skus.push_back(sku);
+  }
+  const compiled_rules c(r);
+  BOOST_CHECK_EQUAL(c.size(), n_items);
+
+  for(unsigned int n = 0; n < n_items; n += 97) {
+    for(quantity q = 0; q < 10; q++) {
+      BOOST_CHECK_EQUAL(c.get_price(skus[n], q), r.get_price(skus[n], q));
+    }
+  }
+  unsigned int unknown = 0;
+  for(unsigned int n = 0; n < 10000; n++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    unknown += !c.has(seed);
+  }
+  BOOST_CHECK_EQUAL(unknown, 10000U);
+
+  // Look the whole catalogue up in a scrambled order, so the cache can't
+  // help.
+  vector<item> order(skus);
+  random_shuffle(order.begin(), order.end());
+  struct timeval start, end;
+  gettimeofday(&start, 0);
+  uint64_t ids = 0;
+  for(vector<item>::const_iterator i = order.begin(); i != order.end(); i++) {
+    ids += c.id(*i);
+  }
+  gettimeofday(&end, 0);
+  const double ns = ((end.tv_sec - start.tv_sec) * 1e9
+                     + (end.tv_usec - start.tv_usec) * 1e3) / n_items;
+  BOOST_CHECK_EQUAL(ids, uint64_t(n_items) * (n_items - 1) / 2);
+  BOOST_MESSAGE(n_items << " SKUs in " << c.memory_used() << " bytes, "
+                << double(c.memory_used()) / n_items << " per SKU; "
+                << ns << "ns per lookup.");
+
+  // A checkout only takes room for what's scanned.
+  checkout co(r);
+  price expected = 0;
+  for(unsigned int n = 0; n < 1000; n++) {
+    co.scan(skus[n * 7]);
+    expected += r.get_price(skus[n * 7], 1);
+  }
+  BOOST_CHECK_EQUAL(co.total(), expected);
+  BOOST_CHECK_EQUAL(co.total(), co.recompute());
+}
+
+// Checkouts following the latest rules while new versions are published
+// must always agree with their own rules, and never go back a version.
+struct lane
+{
+  const rule_set& s;
+  const int& stop;
+  unsigned long& errors;
+
+  lane(const rule_set& s, const int& stop, unsigned long& errors)
+    : s(s), stop(stop), errors(errors)
+  {
+  }
+
+  void operator()()
+  {
+    const string items("ABCD");
+    while(!__atomic_load_n(&stop, __ATOMIC_SEQ_CST)) {
+      checkout co(s, checkout::follow_latest);
+      for(unsigned int n = 0; n < 50; n++) {
+        const unsigned long was = co.version();
+        co.scan(items[n % items.size()]);
+        if(co.version() < was || co.total() != co.recompute()) {
+          __atomic_fetch_add(&errors, 1, __ATOMIC_SEQ_CST);
+        }
+      }
+    }
+  }
+};
+
+void test_shared_rules()
+{
+  checkout_rules r(construct_test_rules());
+  rule_set s(r);
+  checkout pinned(s), latest(s, checkout::follow_latest);
+  BOOST_CHECK_EQUAL(pinned.version(), 1UL);
+  for(unsigned int n = 0; n < 3; n++) {
+    pinned.scan('A');
+    latest.scan('A');
+  }
+  BOOST_CHECK_EQUAL(pinned.total(), 130U);
+  BOOST_CHECK_EQUAL(latest.total(), 130U);
+
+  // A pinned checkout keeps its version after the rule_set has gone.
+  vector<checkout> survivors;
+  {
+    rule_set gone(r);
+    survivors.push_back(checkout(gone));
+  }
+  survivors.back().scan('A');
+  BOOST_CHECK_EQUAL(survivors.back().total(), 50U);
+
+  // A dearer A, and a bundle; only the checkout following the latest
+  // rules sees them, and only once it scans again.
+  r.add('A', 60, make_pair(3, 150));
+  r.add_bundle(count_items("AB"), 75);
+  BOOST_CHECK_EQUAL(s.publish(r), 2UL);
+  BOOST_CHECK_EQUAL(latest.total(), 130U);
+  pinned.scan('B');
+  latest.scan('B');
+  BOOST_CHECK_EQUAL(pinned.version(), 1UL);
+  BOOST_CHECK_EQUAL(pinned.total(), 160U);
+  BOOST_CHECK_EQUAL(latest.version(), 2UL);
+  BOOST_CHECK_EQUAL(latest.total(), r.get_price(count_items("AAAB")));
+  BOOST_CHECK_EQUAL(latest.total(), latest.recompute());
+  BOOST_CHECK_EQUAL(checkout(s).total(), 0U);
+  BOOST_CHECK_EQUAL(checkout(s).version(), 2UL);
+
+  // Dropping an item leaves it out of the total.
+  checkout_rules only_a;
+  only_a.add('A', 50, make_pair(3, 130));
+  s.publish(only_a);
+  latest.refresh();
+  BOOST_CHECK_EQUAL(latest.total(), 130U);
+  BOOST_CHECK_THROW(latest.unscan('B'), logic_error);
+  BOOST_CHECK_EQUAL(pinned.total(), 160U);
+  pinned.unscan('B');
+  BOOST_CHECK_EQUAL(pinned.total(), 130U);
+
+  // Lanes scanning while the rules keep changing under them.
+  r = construct_test_rules();
+  s.publish(r);
+  int stop = 0;
+  unsigned long errors = 0;
+  boost::thread_group lanes;
+  for(unsigned int i = 0; i < 4; i++) {
+    lanes.create_thread(lane(s, stop, errors));
+  }
+  for(price p = 1; p <= 200; p++) {
+    r.add('D', p);
+    s.publish(r);
+  }
+  __atomic_store_n(&stop, 1, __ATOMIC_SEQ_CST);
+  lanes.join_all();
+  BOOST_CHECK_EQUAL(errors, 0UL);
+  BOOST_CHECK_EQUAL(s.latest_number(), 204UL);
+
+  BOOST_MESSAGE("A checkout takes " << sizeof(checkout)
+                << " bytes plus its lines; the rules take "
+                << s.get()->memory_used() << " bytes, once.");
 }
 
 test_suite *init_unit_test_suite(int argc, char *argv[])
 {
   test_suite *t = BOOST_TEST_SUITE("Code Kata 9: Back to the Checkout");
   t->add(BOOST_TEST_CASE(&test_totals));
+  t->add(BOOST_TEST_CASE(&test_compiled_rules));
+  t->add(BOOST_TEST_CASE(&test_promotions));
+  t->add(BOOST_TEST_CASE(&test_bulk_pricing));
   t->add(BOOST_TEST_CASE(&test_incremental));
+  t->add(BOOST_TEST_CASE(&test_large_catalogue));
+  t->add(BOOST_TEST_CASE(&test_shared_rules));
   return t;
 }